@@ -56,12 +56,136 @@ static const uint8_t _hidReportDescriptor[] PROGMEM = {
     0x29, 0xff,                    //   USAGE_MAXIMUM (255)
     0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
     0xc0,                          // END_COLLECTION
+
+  //  Consumer control
+    0x05, 0x0c,                    // USAGE_PAGE (Consumer Devices)
+    0x09, 0x01,                    // USAGE (Consumer Control)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, 0x04,                    //   REPORT_ID (4)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x03,              //   LOGICAL_MAXIMUM (1023)
+    0x19, 0x00,                    //   USAGE_MINIMUM (Unassigned)
+
+  0x2a, 0xff, 0x03,              //   USAGE_MAXIMUM (1023)
+    0x75, 0x10,                    //   REPORT_SIZE (16)
+    0x95, 0x01,                    //   REPORT_COUNT (1)
+    0x81, 0x00,                    //   INPUT (Data,Ary,Abs)
+    0xc0,                          // END_COLLECTION
+
+  //  Mouse
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x02,                    // USAGE (Mouse)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, 0x05,                    //   REPORT_ID (5)
+    0x09, 0x01,                    //   USAGE (Pointer)
+
+  0xa1, 0x00,                    //   COLLECTION (Physical)
+    0x05, 0x09,                    //     USAGE_PAGE (Button)
+    0x19, 0x01,                    //     USAGE_MINIMUM (Button 1)
+    0x29, 0x05,                    //     USAGE_MAXIMUM (Button 5)
+    0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
+
+  0x25, 0x01,                    //     LOGICAL_MAXIMUM (1)
+    0x95, 0x05,                    //     REPORT_COUNT (5)
+    0x75, 0x01,                    //     REPORT_SIZE (1)
+    0x81, 0x02,                    //     INPUT (Data,Var,Abs)
+    0x95, 0x01,                    //     REPORT_COUNT (1)
+
+  0x75, 0x03,                    //     REPORT_SIZE (3)
+    0x81, 0x03,                    //     INPUT (Cnst,Var,Abs)
+    0x05, 0x01,                    //     USAGE_PAGE (Generic Desktop)
+    0x09, 0x30,                    //     USAGE (X)
+    0x09, 0x31,                    //     USAGE (Y)
+
+  0x09, 0x38,                    //     USAGE (Wheel)
+    0x15, 0x81,                    //     LOGICAL_MINIMUM (-127)
+    0x25, 0x7f,                    //     LOGICAL_MAXIMUM (127)
+    0x75, 0x08,                    //     REPORT_SIZE (8)
+    0x95, 0x03,                    //     REPORT_COUNT (3)
+
+  0x81, 0x06,                    //     INPUT (Data,Var,Rel)
+    0xc0,                          //   END_COLLECTION
+    0xc0,                          // END_COLLECTION
+
+  //  Vendor diagnostics
+    0x06, 0x60, 0xff,              // USAGE_PAGE (Vendor Defined 0xFF60)
+    0x09, 0x61,                    // USAGE (Vendor Usage 0x61)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, 0x03,                    //   REPORT_ID (3)
+    0x09, 0x62,                    //   USAGE (Vendor Usage 0x62)
+    0x15, 0x00,                    //   LOGICAL_MINIMUM (0)
+    0x26, 0xff, 0x00,              //   LOGICAL_MAXIMUM (255)
+
+  0x75, 0x08,                    //   REPORT_SIZE (8)
+    0x95, 0x3e,                    //   REPORT_COUNT (62)
+    0x81, 0x02,                    //   INPUT (Data,Var,Abs)
+    0x09, 0x63,                    //   USAGE (Vendor Usage 0x63)
+    0x95, 0x3e,                    //   REPORT_COUNT (62)
+    0x91, 0x02,                    //   OUTPUT (Data,Var,Abs)
+    0xc0,                          // END_COLLECTION
 };
 
+//  The core's HID_ asks for whatever polling interval its version
+//  picked, so we describe the endpoint ourselves and ask for
+//  KEYBOARD_POLL_INTERVAL.  All of our reports share this one
+//  interface, so its report descriptor is ours alone.
+//  It also ignores output reports; the host sends ours with
+//  SET_REPORT on the control endpoint, and we hand them on.
+class KeyboardHID_ : public HID_
+{
+public:
+  uint8_t endpoint(void) { return pluggedEndpoint; }
+  VendorReceiver vendorReceiver = nullptr;
+protected:
+  int getInterface(uint8_t* interfaceCount);
+  bool setup(USBSetup& setup);
+};
+
+int KeyboardHID_::getInterface(uint8_t* interfaceCount)
+{
+	*interfaceCount += 1; // uses 1
+	HIDDescriptor hidInterface = {
+		D_INTERFACE(pluggedInterface, 1, USB_DEVICE_CLASS_HUMAN_INTERFACE, HID_SUBCLASS_NONE, HID_PROTOCOL_NONE),
+		D_HIDREPORT(sizeof(_hidReportDescriptor)),
+		D_ENDPOINT(USB_ENDPOINT_IN(pluggedEndpoint), USB_ENDPOINT_TYPE_INTERRUPT, EPX_SIZE, KEYBOARD_POLL_INTERVAL)
+	};
+	return USBDevice.sendControl(&hidInterface, sizeof(hidInterface));
+}
+
+bool KeyboardHID_::setup(USBSetup& setup)
+{
+	if (pluggedInterface != setup.wIndex) {
+		return false;
+	}
+	// An output report (type 2) with the vendor report ID
+	if (setup.bmRequestType == REQUEST_HOSTTODEVICE_CLASS_INTERFACE &&
+	    setup.bRequest == HID_SET_REPORT && setup.wValueH == 2 &&
+	    setup.wValueL == 3) {
+		uint8_t data[1 + sizeof(VendorReport)];
+		uint32_t len = setup.wLength < sizeof(data) ? setup.wLength : sizeof(data);
+		memset(data, 0, sizeof(data));
+		USBDevice.recvControl(data, len);
+		if (vendorReceiver) {
+			// The first byte is the report ID
+			VendorReport report;
+			memcpy(&report, &data[1], sizeof(report));
+			vendorReceiver(&report);
+		}
+		return true;
+	}
+	return HID_::setup(setup);
+}
+
+static KeyboardHID_& KeyboardHID(void)
+{
+	static KeyboardHID_ obj;
+	return obj;
+}
+
 Keyboard_::Keyboard_(void)
 {
 	static HIDSubDescriptor node(_hidReportDescriptor, sizeof(_hidReportDescriptor));
-	HID().AppendDescriptor(&node);
+	KeyboardHID().AppendDescriptor(&node);
 }
 
 void Keyboard_::begin(void)
@@ -74,7 +198,32 @@ void Keyboard_::end(void)
 
 void Keyboard_::sendReport(KeyReport* keys)
 {
-	HID().SendReport(2,keys,sizeof(KeyReport));
+	KeyboardHID().SendReport(2,keys,sizeof(KeyReport));
+}
+
+void Keyboard_::sendConsumerReport(ConsumerReport* report)
+{
+	KeyboardHID().SendReport(4,report,sizeof(ConsumerReport));
+}
+
+void Keyboard_::sendMouseReport(MouseReport* report)
+{
+	KeyboardHID().SendReport(5,report,sizeof(MouseReport));
+}
+
+void Keyboard_::sendVendorReport(VendorReport* report)
+{
+	KeyboardHID().SendReport(3,report,sizeof(VendorReport));
+}
+
+uint8_t Keyboard_::endpoint(void)
+{
+	return KeyboardHID().endpoint();
+}
+
+void Keyboard_::setVendorReceiver(VendorReceiver receiver)
+{
+	KeyboardHID().vendorReceiver = receiver;
 }
 
 void Keyboard_::releaseAll(void)
@@ -82,6 +231,10 @@ void Keyboard_::releaseAll(void)
   KeyReport report;
   memset(&report, 0, sizeof(report));
 	sendReport(&report);
+  ConsumerReport consumer = {0};
+	sendConsumerReport(&consumer);
+  MouseReport mouse = {0, 0, 0, 0};
+	sendMouseReport(&mouse);
 }
 
 Keyboard_ Keyboard;
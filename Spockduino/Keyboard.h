@@ -21,6 +21,9 @@
 
 #include "HID.h"
 
+//  The polling interval that we ask for, in frames: 1ms at full speed
+#define KEYBOARD_POLL_INTERVAL 1
+
 //  Low level key report: up to 6 keys and shift, ctrl etc at once
 typedef struct
 {
@@ -29,6 +32,50 @@ typedef struct
   uint8_t keys[6];
 } KeyReport;
 
+//  Mouse report: buttons and relative motion
+typedef struct
+{
+  uint8_t buttons;
+  int8_t x;
+  int8_t y;
+  int8_t wheel;
+} MouseReport;
+
+//  Consumer control report: a single 16-bit usage, 0 for none
+typedef struct
+{
+  uint16_t usage;
+} ConsumerReport;
+
+//  Vendor defined diagnostics report.  kind identifies the payload
+//  and index the page within it; the host reassembles the pages.
+typedef struct
+{
+  uint8_t kind;
+  uint8_t index;
+  uint8_t data[60];
+} VendorReport;
+
+enum VendorReportKind : uint8_t
+{
+  kVendorHistogram = 1,
+  kVendorCounters = 2,
+  kVendorTraceHeader = 3,
+  kVendorTrace = 4,
+  kVendorTasks = 5,
+  kVendorExpanders = 6,
+  kVendorChatter = 7,
+  kVendorUsage = 8,
+  kVendorLog = 12,
+  //  Sent by the host, as output reports
+  kVendorKeymapChunk = 9,
+  kVendorKeymapCommit = 10,
+  kVendorKeymapStatus = 11,
+};
+
+//  Called from the USB interrupt with each vendor output report
+typedef void (*VendorReceiver)(const VendorReport* report);
+
 class Keyboard_
 {
 public:
@@ -37,5 +84,11 @@ public:
   void end(void);
   void releaseAll(void);
   void sendReport(KeyReport* keys);
+  void sendConsumerReport(ConsumerReport* report);
+  void sendMouseReport(MouseReport* report);
+  void sendVendorReport(VendorReport* report);
+  //  The interrupt IN endpoint that carries all of the reports
+  uint8_t endpoint(void);
+  void setVendorReceiver(VendorReceiver receiver);
 };
 extern Keyboard_ Keyboard;
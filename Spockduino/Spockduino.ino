@@ -1,77 +1,177 @@
-#define WAT 0
+#define LOG 0
+#define INSTRUMENT 0
+#define TRACE 0
+#define REPLAY 0
+#define SOF_SYNC 0
+#define CHATTER 0
+#define USAGE 0
+#define HOTSWAP 0
+#define SLEEP 0
 #include "HID.h"
-#include "HIDTables.h"
 #include "Keyboard.h"
+#include "keycodes.h"
 
-#define HID_KEYBOARD_A HID_KEYBOARD_A_AND_A
-#define HID_KEYBOARD_B HID_KEYBOARD_B_AND_B
-#define HID_KEYBOARD_C HID_KEYBOARD_C_AND_C
-#define HID_KEYBOARD_D HID_KEYBOARD_D_AND_D
-#define HID_KEYBOARD_E HID_KEYBOARD_E_AND_E
-#define HID_KEYBOARD_F HID_KEYBOARD_F_AND_F
-#define HID_KEYBOARD_G HID_KEYBOARD_G_AND_G
-#define HID_KEYBOARD_H HID_KEYBOARD_H_AND_H
-#define HID_KEYBOARD_I HID_KEYBOARD_I_AND_I
-#define HID_KEYBOARD_J HID_KEYBOARD_J_AND_J
-#define HID_KEYBOARD_K HID_KEYBOARD_K_AND_K
-#define HID_KEYBOARD_L HID_KEYBOARD_L_AND_L
-#define HID_KEYBOARD_M HID_KEYBOARD_M_AND_M
-#define HID_KEYBOARD_N HID_KEYBOARD_N_AND_N
-#define HID_KEYBOARD_O HID_KEYBOARD_O_AND_O
-#define HID_KEYBOARD_P HID_KEYBOARD_P_AND_P
-#define HID_KEYBOARD_Q HID_KEYBOARD_Q_AND_Q
-#define HID_KEYBOARD_R HID_KEYBOARD_R_AND_R
-#define HID_KEYBOARD_S HID_KEYBOARD_S_AND_S
-#define HID_KEYBOARD_T HID_KEYBOARD_T_AND_T
-#define HID_KEYBOARD_U HID_KEYBOARD_U_AND_U
-#define HID_KEYBOARD_V HID_KEYBOARD_V_AND_V
-#define HID_KEYBOARD_W HID_KEYBOARD_W_AND_W
-#define HID_KEYBOARD_X HID_KEYBOARD_X_AND_X
-#define HID_KEYBOARD_Y HID_KEYBOARD_Y_AND_Y
-#define HID_KEYBOARD_Z HID_KEYBOARD_Z_AND_Z
-
-#define HID_KEYBOARD_BRACKET_RIGHT HID_KEYBOARD_RIGHT_BRACKET_AND_RIGHT_CURLY_BRACE
-#define HID_KEYBOARD_BRACKET_LEFT HID_KEYBOARD_LEFT_BRACKET_AND_LEFT_CURLY_BRACE
-#define HID_KEYBOARD_APOSTROPHE HID_KEYBOARD_QUOTE_AND_DOUBLEQUOTE
-#define HID_KEYBOARD_GRAVE HID_KEYBOARD_GRAVE_ACCENT_AND_TILDE
-
-#define HID_KEYBOARD_1 HID_KEYBOARD_1_AND_EXCLAMATION_POINT
-#define HID_KEYBOARD_2 HID_KEYBOARD_2_AND_AT
-#define HID_KEYBOARD_3 HID_KEYBOARD_3_AND_POUND
-#define HID_KEYBOARD_4 HID_KEYBOARD_4_AND_DOLLAR
-#define HID_KEYBOARD_5 HID_KEYBOARD_5_AND_PERCENT
-#define HID_KEYBOARD_6 HID_KEYBOARD_6_AND_CARAT
-#define HID_KEYBOARD_7 HID_KEYBOARD_7_AND_AMPERSAND	
-#define HID_KEYBOARD_8 HID_KEYBOARD_8_AND_ASTERISK	
-#define HID_KEYBOARD_9 HID_KEYBOARD_9_AND_LEFT_PAREN	
-#define HID_KEYBOARD_0 HID_KEYBOARD_0_AND_RIGHT_PAREN
-
-#define KEYBOARD_MODIFIER_LEFTCTRL 1<<0
-#define KEYBOARD_MODIFIER_LEFTSHIFT 1<<1
-#define KEYBOARD_MODIFIER_LEFTALT 1<<2
-#define KEYBOARD_MODIFIER_LEFTGUI 1<<3
-#define KEYBOARD_MODIFIER_RIGHTCTRL 1<<4
-#define KEYBOARD_MODIFIER_RIGHTSHIFT 1<<5
-#define KEYBOARD_MODIFIER_RIGHTALT 1<<6
-#define KEYBOARD_MODIFIER_RIGHTGUI 1<<7
-
-
+#include "timebase.h"
+#include "scheduler.h"
+#include "instrument.h"
+#include "log.h"
+#include "trace.h"
+#include "sof.h"
+#include "matrix.h"
 #include "keymap.h"
+#include "mouse.h"
+#include "chatter.h"
+#include "usage.h"
+#include "hotswap.h"
+#include "boot.h"
 #include "keyscanner.h"
+#include "power.h"
+#include "replay.h"
+
+// The stages of a pass, highest priority first.  Dispatch comes
+// ahead of processing so that a queued report always goes out
+// before the next pass can replace it.
+enum TaskId : uint8_t {
+  kTaskDispatch,
+  kTaskProcess,
+  kTaskScan,
+  kTaskMacro,
+  kTaskDiagnostics,
+};
+
+static matrix_t scannedMatrix;
+static usec_t scannedAt;
+static KeyReport pendingReport;
+static ConsumerReport pendingConsumer;
+static MouseReport pendingMouse;
+static bool reportPending = false;
+static bool consumerPending = false;
+static bool mousePending = false;
+
+static void scanTask(usec_t now) {
+  scannedMatrix = readMatrix();
+  scannedAt = now;
+  scheduler.release(kTaskProcess, now);
+}
+
+static void processTask(usec_t now) {
+  bool keysChanged = processMatrix(scannedMatrix, scannedAt);
+  updateMouse(scannedAt);
+  noteScanActivity(keysChanged);
+  if (numPendingMacros) {
+    scheduler.release(kTaskMacro, now);
+  }
+  if (!keysChanged) {
+    // Only when idle, so that it never delays a report
+    scheduler.release(kTaskDiagnostics, now);
+  }
+}
+
+// The report sinks while the scheduler is running
+static void queueReport(KeyReport *report) {
+  pendingReport = *report;
+  reportPending = true;
+  scheduler.release(kTaskDispatch, nowMicros());
+}
+
+static void queueConsumer(ConsumerReport *report) {
+  pendingConsumer = *report;
+  consumerPending = true;
+  scheduler.release(kTaskDispatch, nowMicros());
+}
+
+static void queueMouse(MouseReport *report) {
+  pendingMouse = *report;
+  mousePending = true;
+  scheduler.release(kTaskDispatch, nowMicros());
+}
+
+static void dispatchTask(usec_t) {
+  // Keyboard reports wait until the host has configured us
+  if (reportPending && !hostConfigured()) {
+    reportPending = false;
+    holdBootReport(pendingReport);
+    noteKeyboardReport(false);
+  }
+  if (bootReportsHeld() && hostConfigured()) {
+    sendBootReports();
+    noteBootReport();
+  }
+  // The keyboard report goes first so that a media key never
+  // delays it
+  if (reportPending) {
+    reportPending = false;
+    uint32_t queued = micros();
+    sendReportToHost(&pendingReport);
+    noteKeyboardReport(true);
+    noteBootReport();
+    sofNoteReport();
+    cadenceNoteReport(queued);
+  }
+  if (consumerPending) {
+    consumerPending = false;
+    sendConsumerToHost(&pendingConsumer);
+  }
+  if (mousePending) {
+    mousePending = false;
+    sendMouseToHost(&pendingMouse);
+  }
+}
+
+static void macroTask(usec_t) {
+  runPendingMacros();
+}
+
+static void diagnosticsTask(usec_t) {
+  sendInstrumentation();
+  sendChatterStats();
+  dumpTraceIfRequested();
+  runReplayIfRequested();
+  dumpUsageIfRequested();
+  flushUsage();
+  flushLog();
+  applyLoadedKeymap();
+  if (!keysHeld()) {
+    maybeRecalibrateKeyScanner();
+  }
+}
+
+static const Task tasks[] = {
+  {dispatchTask, 1000},     // one USB frame
+  {processTask, 1000},
+  {scanTask, 2000},
+  {macroTask, 10000},
+  {diagnosticsTask, 100000},
+};
 
 
 void setup() 
 {
-#if WAT
-  Serial.begin(115200);
-#endif
   Keyboard.begin();
+  initSofSync();
+  initTrace();
+  initChatter();
+  initUsage();
+  initHotswap();
 
   initKeyScanner();
   resetKeyMatrix();
+
+  reportSink = queueReport;
+  consumerSink = queueConsumer;
+  mouseSink = queueMouse;
+  scheduler.init(tasks, sizeof(tasks) / sizeof(tasks[0]));
+  noteBootReady();
 }
 
 void loop() 
 {
-  applyMatrix();
+  waitForNextScan();
+  scheduler.release(kTaskScan, nowMicros());
+  if (bootReportsHeld() && hostConfigured()) {
+    scheduler.release(kTaskDispatch, nowMicros());
+  }
+  scheduler.run();
+  sofEndPass();
+  cadenceEndPass();
 }
@@ -0,0 +1,64 @@
+#pragma once
+// This file holds the boot path.
+// The core attaches to USB before setup() runs, so the host is
+// enumerating us while we bring up the scanner, and we start
+// scanning as soon as setup() returns rather than waiting for it.
+// A keyboard report made before the host has configured us would
+// be dropped, so until then we hold them here, and send them in
+// order once it has; a key that was held down through enumeration
+// is reported as soon as the host can see it.
+// With INSTRUMENT set the counters record when setup() finished,
+// when the host configured us and when the first key report went
+// out, in micros() since the core started its clock just after the
+// bootloader.
+
+static constexpr uint8_t kMaxBootReports = 8;
+
+static KeyReport bootReports[kMaxBootReports];
+static uint8_t numBootReports = 0;
+static bool hostReady = false;
+static bool firstReportSent = false;
+
+// Called at the end of setup()
+void noteBootReady() {
+  INSTR_SET(kCountBootReady, micros());
+}
+
+// Returns true once the host has configured us
+bool hostConfigured() {
+  if (!hostReady && USBDevice.configured()) {
+    hostReady = true;
+    INSTR_SET(kCountBootConfigured, micros());
+  }
+  return hostReady;
+}
+
+// Holds a keyboard report until the host is ready for it.  When
+// there is no room we replace the newest, so that the last report
+// that the host sees is always the current state.
+void holdBootReport(const KeyReport &report) {
+  if (numBootReports == kMaxBootReports) {
+    --numBootReports;
+  }
+  bootReports[numBootReports++] = report;
+}
+
+bool bootReportsHeld() {
+  return numBootReports != 0;
+}
+
+// Sends the held reports, oldest first
+void sendBootReports() {
+  for (uint8_t i = 0; i < numBootReports; ++i) {
+    sendReportToHost(&bootReports[i]);
+  }
+  numBootReports = 0;
+}
+
+// Called with each keyboard report that goes to the host
+void noteBootReport() {
+  if (!firstReportSent) {
+    firstReportSent = true;
+    INSTR_SET(kCountBootFirstReport, micros());
+  }
+}
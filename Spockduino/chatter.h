@@ -0,0 +1,159 @@
+#pragma once
+// This file holds the per-key chatter and bounce statistics.
+// Set CHATTER to 1 in Spockduino.ino to have scanMatrix() feed
+// every raw, pre-debounce edge in here.  Edges that follow one
+// another within kChatterQuiet belong to one burst: the first edge
+// of a burst is the real transition and the rest are bounces.
+// For each key we count presses and bounces, and record the
+// longest burst and the shortest time from one press to the
+// next, which catches a switch that double types even when each
+// burst looks clean.  The counters saturate rather than wrap.
+// Times are only as fine as the scan period, since that is when
+// we see the edges.
+// The statistics are streamed a page at a time over the vendor
+// diagnostics report; tools/spock-chatter.py reads them out and
+// suggests a debounce time for each key.
+
+#ifndef CHATTER
+#define CHATTER 0
+#endif
+
+struct KeyChatter {
+  uint16_t presses;
+  uint16_t bounces;     // edges after the first in each burst
+  uint8_t maxBurst;     // longest burst, in kChatterBurstUnit
+  uint8_t minInterval;  // shortest press to press, in milliseconds
+};
+
+// How long a key must be still before its next edge starts a burst
+static constexpr uint32_t kChatterQuiet = 10000; // microseconds
+static constexpr uint32_t kChatterBurstUnit = 64; // microseconds
+// How many keys we follow through a burst at once
+static constexpr uint8_t kChatterBursts = 8;
+static constexpr uint32_t kChatterPageInterval = 100; // milliseconds
+static_assert(sizeof(KeyChatter) == 6,
+              "tools/spock-chatter.py expects 6 byte records");
+static constexpr uint8_t kChatterPerPage =
+    sizeof(VendorReport::data) / sizeof(KeyChatter);
+static constexpr uint8_t kChatterPages =
+    (matrix_t::kKeys + kChatterPerPage - 1) / kChatterPerPage;
+
+#if CHATTER
+static constexpr uint8_t kChatterUnused = 0xff;
+
+struct chatterburst_t {
+  uint8_t scanCode; // kChatterUnused if free
+  uint32_t start;   // micros() of the first edge
+  uint32_t last;    // micros() of the latest edge
+};
+
+KeyChatter keyChatter[matrix_t::kKeys];
+static uint32_t chatterLastPress[matrix_t::kKeys]; // low bits of micros
+static chatterburst_t chatterBursts[kChatterBursts];
+static uint32_t chatterLastPage = 0;
+static uint8_t chatterNextPage = 0;
+
+void initChatter() {
+  memset(keyChatter, 0, sizeof(keyChatter));
+  for (auto &c : keyChatter) {
+    c.minInterval = 0xff;
+  }
+  for (auto &b : chatterBursts) {
+    b.scanCode = kChatterUnused;
+  }
+}
+
+// Returns the burst for scanCode that is still open at now, or
+// claims one for it: a free one, or else the one that has been
+// quiet the longest.  Sets isNew when the burst starts here.
+static chatterburst_t &chatterBurst(uint8_t scanCode, uint32_t now,
+                                    bool &isNew) {
+  chatterburst_t *oldest = &chatterBursts[0];
+  for (auto &b : chatterBursts) {
+    if (b.scanCode == scanCode) {
+      isNew = now - b.last >= kChatterQuiet;
+      return b;
+    }
+    if (b.scanCode == kChatterUnused ||
+        (oldest->scanCode != kChatterUnused &&
+         now - b.last > now - oldest->last)) {
+      oldest = &b;
+    }
+  }
+  isNew = true;
+  oldest->scanCode = scanCode;
+  return *oldest;
+}
+
+static void chatterEdge(uint8_t scanCode, bool isDown, uint32_t now) {
+  auto &stats = keyChatter[scanCode];
+  bool isNew;
+  auto &b = chatterBurst(scanCode, now, isNew);
+  b.last = now;
+  if (!isNew) {
+    if (stats.bounces < 0xffff) {
+      ++stats.bounces;
+    }
+    uint32_t burst = (now - b.start) / kChatterBurstUnit;
+    if (burst > stats.maxBurst) {
+      stats.maxBurst = burst < 0xff ? burst : 0xff;
+    }
+    return;
+  }
+
+  b.start = now;
+  if (isDown) {
+    if (stats.presses) {
+      // The difference is wrap safe; a gap longer than minInterval
+      // can hold, 255ms, is never the shortest and is skipped
+      uint32_t interval = (now - chatterLastPress[scanCode]) / 1000;
+      if (interval < stats.minInterval) {
+        stats.minInterval = interval;
+      }
+    }
+    chatterLastPress[scanCode] = now;
+    if (stats.presses < 0xffff) {
+      ++stats.presses;
+    }
+  }
+}
+
+// Called by scanMatrix() with the raw bits of a row that changed
+void chatterRow(uint8_t rowNum, matrix_t::row_t was, matrix_t::row_t bits,
+                uint32_t now) {
+  for (auto changed = matrix_t::row_t(was ^ bits); changed;
+       changed &= changed - 1) {
+    uint8_t colNum = __builtin_ctz(changed);
+    chatterEdge(matrix_t::scanCode(rowNum, colNum),
+                bits & matrix_t::bit(colNum), now);
+  }
+}
+
+// Send the next page of the statistics, round robin.  Like
+// sendInstrumentation(), call this only from an idle pass.
+void sendChatterStats() {
+  auto now = millis();
+  if (now - chatterLastPage < kChatterPageInterval) {
+    return;
+  }
+  chatterLastPage = now;
+
+  VendorReport report;
+  memset(&report, 0, sizeof(report));
+  report.kind = kVendorChatter;
+  report.index = chatterNextPage;
+  uint16_t first = chatterNextPage * kChatterPerPage;
+  uint16_t count = matrix_t::kKeys - first < kChatterPerPage
+                       ? matrix_t::kKeys - first
+                       : kChatterPerPage;
+  memcpy(report.data, &keyChatter[first], count * sizeof(KeyChatter));
+  Keyboard.sendVendorReport(&report);
+
+  chatterNextPage = (chatterNextPage + 1) % kChatterPages;
+}
+#else
+void initChatter() {}
+inline void chatterRow(uint8_t, matrix_t::row_t, matrix_t::row_t,
+                       uint32_t) {}
+void sendChatterStats() {}
+#endif
@@ -0,0 +1,170 @@
+#pragma once
+// This file holds the keymap hot swap.
+// Set HOTSWAP to 1 in Spockduino.ino to accept a new keymap from
+// the host over the vendor report, without reflashing or dropping
+// off the bus.  tools/spock-keymap.py sends the packed keymap, the
+// action_t values of each layer in scan code order, a chunk at a
+// time into a shadow buffer, and then commits it along with its
+// CRC-32.  We check the CRC and that every action is one that we
+// can run, and then swap it in between two passes by pointing
+// activeKeymap at the shadow; the buffer that was active becomes
+// the shadow for the next upload.  Keys that are held keep the
+// action that they were pressed with, so they release cleanly
+// across the swap.
+// The chunks arrive in the USB interrupt; the check and the swap
+// happen in an idle pass, and the result goes back to the host in
+// a kVendorKeymapStatus report.  Committing zero layers goes back
+// to the built in keymap.  A loaded keymap lasts until reset.
+
+static constexpr uint8_t kMaxLayers = 4;
+static constexpr uint16_t kKeymapChunkSize = sizeof(VendorReport::data);
+static constexpr uint16_t kMaxKeymapBytes =
+    kMaxLayers * matrix_t::kKeys * sizeof(action_t);
+static constexpr uint8_t kMaxKeymapChunks =
+    (kMaxKeymapBytes + kKeymapChunkSize - 1) / kKeymapChunkSize;
+static_assert(kMaxKeymapChunks < 32, "chunks must fit in keymapChunks");
+static_assert(kNumLayers <= kMaxLayers, "the built in keymap must fit");
+
+enum KeymapStatus : uint8_t {
+  kKeymapOk,
+  kKeymapBadCrc,
+  kKeymapMissingChunks,
+  kKeymapBadLayers, // too many layers, or a LAYER() beyond them
+  kKeymapBadOpcode,
+};
+
+// The data of a kVendorKeymapCommit report
+struct KeymapCommit {
+  uint8_t layers;
+  uint8_t reserved[3];
+  uint32_t crc; // of the layers * kKeys actions
+};
+
+// The data of a kVendorKeymapStatus report
+struct KeymapStatusReport {
+  uint8_t status;
+  uint8_t layers;   // of the active keymap
+  uint8_t reserved[2];
+  uint32_t crc;     // of the active keymap, 0 if built in
+};
+
+#if HOTSWAP
+static action_t loadedKeymaps[2][kMaxLayers][matrix_t::kKeys];
+// Bit n is set once chunk n is in the shadow
+static volatile uint32_t keymapChunks = 0;
+static volatile bool keymapCommitPending = false;
+static KeymapCommit keymapCommit;
+static uint32_t activeKeymapCrc = 0;
+
+// The loaded keymap buffer that isn't active
+static action_t (*shadowKeymap())[matrix_t::kKeys] {
+  return activeKeymap == loadedKeymaps[0] ? loadedKeymaps[1]
+                                          : loadedKeymaps[0];
+}
+
+// Called from the USB interrupt.  A new upload starts with chunk
+// 0; anything that arrives while a commit is pending is dropped.
+static void receiveKeymapReport(const VendorReport *report) {
+  if (keymapCommitPending) {
+    return;
+  }
+  if (report->kind == kVendorKeymapChunk &&
+      report->index < kMaxKeymapChunks) {
+    uint16_t offset = report->index * kKeymapChunkSize;
+    uint16_t len = kMaxKeymapBytes - offset < kKeymapChunkSize
+                       ? kMaxKeymapBytes - offset
+                       : kKeymapChunkSize;
+    if (report->index == 0) {
+      keymapChunks = 0;
+    }
+    memcpy(reinterpret_cast<uint8_t *>(shadowKeymap()) + offset,
+           report->data, len);
+    keymapChunks |= 1u << report->index;
+  } else if (report->kind == kVendorKeymapCommit) {
+    memcpy(&keymapCommit, report->data, sizeof(keymapCommit));
+    keymapCommitPending = true;
+  }
+}
+
+static uint32_t keymapCrc(const void *buf, uint16_t len) {
+  auto bytes = static_cast<const uint8_t *>(buf);
+  uint32_t crc = 0xffffffff;
+  while (len--) {
+    crc ^= *bytes++;
+    for (uint8_t bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static KeymapStatus checkKeymap(const action_t (*map)[matrix_t::kKeys],
+                                uint8_t layers) {
+  for (uint8_t layer = 0; layer < layers; ++layer) {
+    for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+      auto action = map[layer][scanCode];
+      auto opcode = action & kMask;
+      if (opcode > kMouseMove || (opcode == 0 && action != ___)) {
+        return kKeymapBadOpcode;
+      }
+      if (opcode == kLayer && (action & 0xff) >= layers) {
+        return kKeymapBadLayers;
+      }
+    }
+  }
+  return kKeymapOk;
+}
+
+static void sendKeymapStatus(KeymapStatus status) {
+  VendorReport report;
+  memset(&report, 0, sizeof(report));
+  report.kind = kVendorKeymapStatus;
+  KeymapStatusReport reply = {status, activeLayers, {0, 0}, activeKeymapCrc};
+  memcpy(report.data, &reply, sizeof(reply));
+  Keyboard.sendVendorReport(&report);
+}
+
+// Checks a committed keymap and swaps it in.  Call this between
+// passes, from an idle one.
+void applyLoadedKeymap() {
+  if (!keymapCommitPending) {
+    return;
+  }
+  auto shadow = shadowKeymap();
+  uint8_t layers = keymapCommit.layers;
+  uint16_t bytes = layers * sizeof(shadow[0]);
+  uint32_t needed =
+      (1u << ((bytes + kKeymapChunkSize - 1) / kKeymapChunkSize)) - 1;
+  KeymapStatus status;
+  if (layers > kMaxLayers) {
+    status = kKeymapBadLayers;
+  } else if ((keymapChunks & needed) != needed) {
+    status = kKeymapMissingChunks;
+  } else if (keymapCrc(shadow, bytes) != keymapCommit.crc) {
+    status = kKeymapBadCrc;
+  } else {
+    status = checkKeymap(shadow, layers);
+  }
+
+  if (status == kKeymapOk && layers == 0) {
+    activeKeymap = keymap;
+    activeLayers = kNumLayers;
+    activeKeymapCrc = 0;
+  } else if (status == kKeymapOk) {
+    activeKeymap = shadow;
+    activeLayers = layers;
+    activeKeymapCrc = keymapCommit.crc;
+  }
+  keymapChunks = 0;
+  keymapCommitPending = false;
+  LOG_INFO(HOTSWAP, kLogKeymapLoaded, status, activeLayers, activeKeymapCrc);
+  sendKeymapStatus(status);
+}
+
+void initHotswap() {
+  Keyboard.setVendorReceiver(receiveKeymapReport);
+}
+#else
+void initHotswap() {}
+void applyLoadedKeymap() {}
+#endif
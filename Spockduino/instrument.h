@@ -0,0 +1,149 @@
+#pragma once
+// This file holds the hot path instrumentation.
+// Set INSTRUMENT to 1 in Spockduino.ino to record micros()
+// timestamps at the stage boundaries of a scan, accumulating them
+// into fixed log2 bucket histograms along with some event counters.
+// The data is streamed to the host a page at a time using the
+// vendor diagnostics report, so reading it out doesn't perturb
+// the timing the way that serial prints would.
+// With INSTRUMENT set to 0 the macros below expand to nothing.
+
+#ifndef INSTRUMENT
+#define INSTRUMENT 0
+#endif
+
+enum InstrHistogram : uint8_t {
+  kHistScan,           // duration of scanMatrix()
+  kHistI2CRead,        // duration of the expander column read
+  kHistDebounce,       // first raw change to stable matrix
+  kHistScanToReport,   // start of processMatrix() to report queued
+  kHistUsbSend,        // duration of Keyboard.sendReport()
+  kHistScanToSof,      // start of scan to the SOF that carried its report
+  kHistReportDelivery, // keyboard report loaded to taken by the host
+  kHistReportInterval, // between back to back reports taken by the host
+  kNumHistograms
+};
+
+enum InstrCounter : uint8_t {
+  kCountScans,
+  kCountReports,
+  kCountKeyEvents,
+  kCountDroppedKeys,     // no free keyStates slot
+  kCountI2CErrors,
+  kCountDebounceResets,
+  kCountSettleSaved,     // microseconds saved by calibrated row settling
+  kCountExpanderOffline,
+  kCountExpanderRetries,
+  kCountBootReady,       // micros() when setup() finished
+  kCountBootConfigured,  // micros() when the host configured us
+  kCountBootFirstReport, // micros() when the first key report went out
+  kNumCounters
+};
+
+// Bucket n counts samples in [2^n, 2^(n+1)) microseconds; the
+// first bucket also takes 0 and the last is open ended.
+static constexpr uint8_t kNumBuckets = 15;
+
+// Per expander I2C read timing, reported on a page of its own
+struct InstrDeviceStats {
+  uint32_t reads;
+  uint32_t errors;
+  uint32_t totalReadTime; // microseconds
+  uint32_t maxReadTime;   // microseconds
+};
+static constexpr uint8_t kInstrMaxDevices =
+    sizeof(VendorReport::data) / sizeof(InstrDeviceStats);
+
+// How often we send the next page of data to the host
+static constexpr uint32_t kInstrPageInterval = 50; // milliseconds
+
+#if INSTRUMENT
+uint32_t instrHistograms[kNumHistograms][kNumBuckets];
+uint32_t instrCounters[kNumCounters];
+InstrDeviceStats instrDevices[kInstrMaxDevices];
+static uint32_t instrLastPage = 0;
+static uint8_t instrNextPage = 0;
+static_assert(sizeof(instrHistograms[0]) <= sizeof(VendorReport::data),
+              "histogram must fit in a single page");
+static_assert(sizeof(instrCounters) <= sizeof(VendorReport::data),
+              "counters must fit in a single page");
+static_assert(sizeof(Scheduler::stats) <= sizeof(VendorReport::data),
+              "task stats must fit in a single page");
+
+static inline void instrRecord(InstrHistogram hist, uint32_t elapsed) {
+  uint8_t bucket = elapsed ? 31 - __builtin_clz(elapsed) : 0;
+  if (bucket >= kNumBuckets) {
+    bucket = kNumBuckets - 1;
+  }
+  ++instrHistograms[hist][bucket];
+}
+
+static inline void instrDeviceRead(uint8_t dev, uint32_t elapsed, bool ok) {
+  auto &s = instrDevices[dev];
+  ++s.reads;
+  if (!ok) {
+    ++s.errors;
+  }
+  s.totalReadTime += elapsed;
+  if (elapsed > s.maxReadTime) {
+    s.maxReadTime = elapsed;
+  }
+  instrRecord(kHistI2CRead, elapsed);
+}
+
+// Send the next page of instrumentation data, round robin.
+// Call this from a pass that didn't send a key report so that
+// it never delays one.
+void sendInstrumentation() {
+  auto now = millis();
+  if (now - instrLastPage < kInstrPageInterval) {
+    return;
+  }
+  instrLastPage = now;
+
+  VendorReport report;
+  memset(&report, 0, sizeof(report));
+  if (instrNextPage < kNumHistograms) {
+    report.kind = kVendorHistogram;
+    report.index = instrNextPage;
+    memcpy(report.data, instrHistograms[instrNextPage],
+           sizeof(instrHistograms[0]));
+  } else if (instrNextPage == kNumHistograms) {
+    report.kind = kVendorCounters;
+    report.index = 0;
+    memcpy(report.data, instrCounters, sizeof(instrCounters));
+  } else if (instrNextPage == kNumHistograms + 1) {
+    report.kind = kVendorTasks;
+    report.index = 0;
+    memcpy(report.data, scheduler.stats, sizeof(scheduler.stats));
+  } else {
+    report.kind = kVendorExpanders;
+    report.index = 0;
+    memcpy(report.data, instrDevices, sizeof(instrDevices));
+  }
+  Keyboard.sendVendorReport(&report);
+
+  instrNextPage = (instrNextPage + 1) % (kNumHistograms + 3);
+}
+
+#define INSTR_TIMESTAMP(var) uint32_t var = micros()
+#define INSTR_MARK(var) var = micros()
+#define INSTR_RECORD(hist, start) instrRecord(hist, micros() - (start))
+#define INSTR_VALUE(hist, value) instrRecord(hist, value)
+#define INSTR_COUNT(counter) ++instrCounters[counter]
+#define INSTR_ADD(counter, n) instrCounters[counter] += (n)
+#define INSTR_SET(counter, value) instrCounters[counter] = (value)
+#define INSTR_DEVICE_READ(dev, start, ok) \
+  instrDeviceRead(dev, micros() - (start), ok)
+#else
+void sendInstrumentation() {}
+
+#define INSTR_TIMESTAMP(var)
+#define INSTR_MARK(var)
+#define INSTR_RECORD(hist, start)
+#define INSTR_VALUE(hist, value)
+#define INSTR_COUNT(counter)
+#define INSTR_ADD(counter, n)
+#define INSTR_SET(counter, value)
+#define INSTR_DEVICE_READ(dev, start, ok)
+#endif
@@ -10,6 +10,11 @@
 // scan code (per layer) that translates the state for the scan
 // code into a HID key report.
 
+// Set by Spockduino.ino when hotswap.h may load a keymap at runtime
+#ifndef HOTSWAP
+#define HOTSWAP 0
+#endif
+
 static constexpr uint32_t kMask = 0xf00;
 static constexpr uint32_t kKeyPress = 0x100;
 static constexpr uint32_t kModifier = 0x200;
@@ -19,13 +24,15 @@ static constexpr uint32_t kToggleMod = 0x500;
 static constexpr uint32_t kKeyAndMod = 0x600;
 static constexpr uint32_t kMouseButton = 0x700;
 static constexpr uint32_t kMacro = 0x800;
-static constexpr uint32_t kTapInterval = 250; // milliseconds
+static constexpr uint32_t kConsumer = 0x900; // usage in the high 16 bits
+static constexpr uint32_t kMouseMove = 0xa00;
+static constexpr uint32_t kTapInterval = 250000; // microseconds
 typedef uint32_t action_t;
 
 #define PASTE(a, b) a ## b
 
 #define ___      0
-#define CONS(a)  0  // FIXME
+#define CONS(a)  kConsumer | (uint32_t(PASTE(HID_CONSUMER_, a)) << 16)
 #define KEY(a)   kKeyPress | PASTE(HID_KEYBOARD_, a)
 #define MOD(a)   kModifier | PASTE(KEYBOARD_MODIFIER_, a)
 #define TMOD(a)  kToggleMod | PASTE(KEYBOARD_MODIFIER_, a)
@@ -33,6 +40,18 @@ typedef uint32_t action_t;
 #define KANDMOD(a, b) kKeyAndMod | PASTE(HID_KEYBOARD_, a) | (PASTE(KEYBOARD_MODIFIER_, b) << 16)
 #define LAYER(n) kLayer | n
 #define MACRO(n)  kMacro | n
+#define MBTN(a)  kMouseButton | PASTE(MOUSE_BUTTON_, a)
+#define MMOVE(a) kMouseMove | PASTE(MOUSE_MOVE_, a)
+
+#define MOUSE_BUTTON_LEFT 1<<0
+#define MOUSE_BUTTON_RIGHT 1<<1
+#define MOUSE_BUTTON_MIDDLE 1<<2
+#define MOUSE_MOVE_UP 1<<0
+#define MOUSE_MOVE_DOWN 1<<1
+#define MOUSE_MOVE_LEFT 1<<2
+#define MOUSE_MOVE_RIGHT 1<<3
+#define MOUSE_MOVE_WHEEL_UP 1<<4
+#define MOUSE_MOVE_WHEEL_DOWN 1<<5
 
 // This maps the human perceived logical keycap layout to the less intuitive
 // minimized hardware key matrix wiring.  This mapping is coupled with the
@@ -60,90 +79,193 @@ typedef uint32_t action_t;
              l12, l20, l43, l60, l24, l65, l53, r13, r25, r42, r65, r21, r60, r52, \
              l02, l30, l34, l40, l05, l64, l63, r03, r35, r31, r45, r00, r61, r62}
 
-// Represents the state of some key
-struct keystate {
-  uint8_t scanCode;
-  bool down;
-  uint32_t lastChange;
-  uint32_t priorChange;
-  action_t action;
-};
 // We allow tracking the state of up to 16 keys.
 // You can make this as large or small as makes sense to you.
-// The constraint is available ram and fingers.
-struct keystate keyStates[16];
+// The constraint is available ram and fingers; it must be a
+// multiple of 4 and fit in slotmask_t.
+static constexpr uint8_t kNumSlots = 16;
+typedef uint16_t slotmask_t;
+static constexpr uint8_t kNoSlot = 0xff;
+static constexpr slotmask_t kAllSlots =
+    slotmask_t(~slotmask_t(0)) >> (sizeof(slotmask_t) * 8 - kNumSlots);
+static_assert(kNumSlots % 4 == 0 && kNumSlots <= sizeof(slotmask_t) * 8,
+              "kNumSlots must be a multiple of 4 that fits in slotmask_t");
+static_assert(kNumSlots < kTraceNoSlot, "slot numbers must fit in the trace");
+
+// Represents the state of the keys that we are tracking, as
+// parallel arrays indexed by slot.  The scan codes are contiguous
+// so that we can search them a word at a time and the flags are
+// bitmasks so that questions like "is any key down?" are a single
+// test.  Timestamps are offsets from keyEpoch in ticks of
+// 2^kKeyTickShift microseconds, and keyTime() advances the epoch
+// before they can overflow.
+struct keystates {
+  union {
+    uint8_t scanCode[kNumSlots]; // 0xff if the slot is unused
+    uint32_t scanCodeWords[kNumSlots / 4];
+  };
+  slotmask_t used;
+  slotmask_t down;
+  slotmask_t pushedLayer; // layer keys whose press pushed their layer
+  uint16_t lastChange[kNumSlots];
+  uint16_t priorChange[kNumSlots];
+  action_t action[kNumSlots];
+};
+struct keystates keyStates;
+static usec_t keyEpoch = 0;
+static constexpr uint8_t kKeyTickShift = 4; // 16us ticks
+static constexpr uint16_t kTapTicks = kTapInterval >> kKeyTickShift;
+// keyTime() keeps at least this many ticks of history
+static constexpr uint16_t kKeyHistoryTicks = 0x4000;
+static_assert(kKeyHistoryTicks > kTapTicks,
+              "tap interval must fit in the key timestamp history");
 
 // Allow for up to 8 layers to be stacked up
 uint8_t layer_stack[8];
 static uint8_t layer_pos = 0;
 
-struct matrix_t {
-  uint16_t rows[6];
-};
-struct matrix_t lastRead = {0,0,0,0,0,0};
+// The Spock matrix, as wired in keyscanner.h
+typedef Matrix<6, 14> matrix_t;
+static_assert(matrix_t::kKeys < 0xff,
+              "scan codes must fit in a byte, with 0xff spare");
+matrix_t lastRead = {};
 
 // true if we synthesized a key tap on the last run; we will need
 // to ensure that we follow up with a release event on the next loop
 static bool last_was_tap = false;
 
-struct matrix_t readMatrix();
-void initKeyScanner();
+matrix_t readMatrix();
+void requestTraceReplay();
+void requestSyntheticReplay();
+void requestPropertyCheck();
+inline void requestUsageDump();
+inline void usageCountPress(uint8_t scanCode);
+
+// Where processMatrix() sends its reports; the replay driver
+// points this elsewhere while it runs.
+static void sendReportToHost(KeyReport *report) {
+  INSTR_TIMESTAMP(sendStart);
+  Keyboard.sendReport(report);
+  INSTR_RECORD(kHistUsbSend, sendStart);
+}
+static void (*reportSink)(KeyReport *report) = sendReportToHost;
 
-void resetKeyMatrix() {
+// Media keys go out on their own report, and only when the usage
+// changes, so that they never cost a keyboard report
+static void sendConsumerToHost(ConsumerReport *report) {
+  Keyboard.sendConsumerReport(report);
+}
+static void (*consumerSink)(ConsumerReport *report) = sendConsumerToHost;
+static uint16_t lastConsumer = 0;
+
+// Mouse and media keys have reports of their own, and don't
+// affect the keyboard report
+static bool hasOwnReport(action_t action) {
+  auto opcode = action & kMask;
+  return opcode == kConsumer || opcode == kMouseButton ||
+         opcode == kMouseMove;
+}
+
+// Macros triggered during a pass are queued here and played back
+// by runPendingMacros(), after the report for the pass has gone.
+static uint8_t pendingMacros[4];
+static uint8_t numPendingMacros = 0;
+
+// Resets the keymap engine state, without touching the hardware
+void resetKeyState() {
+  numPendingMacros = 0;
   layer_pos = 0;
   layer_stack[0] = 0;
   last_was_tap = false;
+  lastConsumer = 0;
   memset(&lastRead, 0, sizeof(lastRead));
-  memset(keyStates, 0xff, sizeof(keyStates));
-  initKeyScanner();
+  keyEpoch = 0;
+  memset(&keyStates, 0, sizeof(keyStates));
+  memset(keyStates.scanCode, 0xff, sizeof(keyStates.scanCode));
+}
+
+void resetKeyMatrix() {
+  resetKeyState();
 
   Keyboard.releaseAll();
 }
 
-void printState(struct keystate *state) {
-  Serial.print("scanCode=");
-  Serial.print(state->scanCode, HEX);
-  Serial.print(" down=");
-  Serial.print(state->down);
-  Serial.print(" lastChange=");
-  Serial.print(state->lastChange);
-  Serial.print(" action=");
-  Serial.print(state->action, HEX);
-  Serial.println("");
+void logState(uint8_t slot) {
+  LOG_DEBUG(KEYMAP, kLogKeyState, keyStates.scanCode[slot],
+            (keyStates.down >> slot) & 1,
+            keyEpoch + (keyStates.lastChange[slot] << kKeyTickShift),
+            keyStates.action[slot]);
 }
 
-struct keystate* stateSlot(uint8_t scanCode, uint32_t now) {
-  struct keystate *vacant = nullptr;
-  struct keystate *reap = nullptr;
-  for (auto &s : keyStates) {
-    if (s.scanCode == scanCode) {
-      return &s;
-    }
-    if (!vacant && s.scanCode == 0xff) {
-      vacant = &s;
-      continue;
+// Returns now in ticks since keyEpoch.  Once the offset gets large
+// we move the epoch forward, saturating timestamps that fall before
+// it at 0; those are at least kKeyHistoryTicks old, which is long
+// enough ago that their precise age doesn't matter.
+static uint16_t keyTime(usec_t now) {
+  usec_t delta = (now - keyEpoch) >> kKeyTickShift;
+  if (delta >= 0xc000) {
+    usec_t shift = delta - kKeyHistoryTicks;
+    for (uint8_t i = 0; i < kNumSlots; ++i) {
+      auto &last = keyStates.lastChange[i];
+      auto &prior = keyStates.priorChange[i];
+      last = last > shift ? last - shift : 0;
+      prior = prior > shift ? prior - shift : 0;
     }
-    if (!s.down) {
-      if (!reap) {
-        reap = &s;
-      } else if (now - s.lastChange > now - reap->lastChange) {
-        // Idle longer than the other reapable candidate; choose
-        // the eldest of them
-        reap = &s;
+    keyEpoch += shift << kKeyTickShift;
+    delta -= shift;
+  }
+  return delta;
+}
+
+// Returns the slot that is tracking scanCode, or kNoSlot
+static uint8_t findSlot(uint8_t scanCode) {
+  uint32_t pattern = scanCode * 0x01010101u;
+  for (uint8_t w = 0; w < kNumSlots / 4; ++w) {
+    // A byte of x is zero where the scan code matches
+    uint32_t x = keyStates.scanCodeWords[w] ^ pattern;
+    if ((x - 0x01010101u) & ~x & 0x80808080u) {
+      for (uint8_t b = 0; b < 4; ++b) {
+        if (((x >> (b * 8)) & 0xff) == 0) {
+          return w * 4 + b;
+        }
       }
     }
   }
+  return kNoSlot;
+}
+
+// Returns the slot for scanCode: the one already tracking it, or
+// a vacant one, or the one that has been idle the longest, or
+// kNoSlot if all slots are held down.
+uint8_t stateSlot(uint8_t scanCode, uint16_t now) {
+  auto slot = findSlot(scanCode);
+  if (slot != kNoSlot) {
+    return slot;
+  }
+  slotmask_t vacant = ~keyStates.used & kAllSlots;
   if (vacant) {
-    return vacant;
+    return __builtin_ctz(vacant);
+  }
+  slot = kNoSlot;
+  for (slotmask_t reap = ~keyStates.down & keyStates.used; reap;
+       reap &= reap - 1) {
+    uint8_t s = __builtin_ctz(reap);
+    if (slot == kNoSlot ||
+        uint16_t(now - keyStates.lastChange[s]) >
+            uint16_t(now - keyStates.lastChange[slot])) {
+      // Idle longer than the other reapable candidate; choose
+      // the eldest of them
+      slot = s;
+    }
   }
-  return reap;
+  return slot;
 }
 
-const action_t keymap[2][84] = {
+constexpr action_t keymap[2][matrix_t::kKeys] = {
   // Layer 0
   KEYMAP(
     // LEFT
-    KEY(ESCAPE),            ___,            KEY(VOLUME_DOWN),           KEY(VOLUME_UP),KEY(MINUS_AND_UNDERSCORE), KEY(EQUALS_AND_PLUS),
+    KEY(ESCAPE),            ___,            CONS(VOLUME_DECREMENT),     CONS(VOLUME_INCREMENT),KEY(MINUS_AND_UNDERSCORE), KEY(EQUALS_AND_PLUS),
     KEY(GRAVE),             KEY(1),         KEY(2),                     KEY(3),        KEY(4),                    KEY(5),
     KEY(TAB),               KEY(Q),         KEY(W),                     KEY(E),        KEY(R),                    KEY(T),
     TAPH(ESCAPE, LEFTCTRL), KEY(A),         KEY(S),                     KEY(D),        KEY(F),                    KEY(G),
@@ -152,7 +274,7 @@ const action_t keymap[2][84] = {
     ___,                    KEY(PAGE_DOWN), KANDMOD(INSERT, LEFTSHIFT), MOD(LEFTSHIFT),LAYER(1),                  KEY(DELETE),
 
     // RIGHT
-    KEY(BRACKET_LEFT), KEY(BRACKET_RIGHT), KEY(MUTE),                KEY(PRINTSCREEN),        ___,       ___,
+    KEY(BRACKET_LEFT), KEY(BRACKET_RIGHT), CONS(MUTE),               KEY(PRINTSCREEN),        ___,       ___,
     KEY(6),            KEY(7),             KEY(8),                   KEY(9),     KEY(0),    ___,
     KEY(Y),            KEY(U),             KEY(I),                   KEY(O),     KEY(P),    KEY(BACKSLASH_AND_PIPE),
     KEY(H),            KEY(J),             KEY(K),                   KEY(L),     KEY(SEMICOLON_AND_COLON),  KEY(APOSTROPHE),
@@ -165,11 +287,11 @@ const action_t keymap[2][84] = {
   // Layer 1
   KEYMAP(
     // LEFT
-    ___,         ___,       KEY(F14),  KEY(F15),         ___,          ___,
+    MACRO(1),    MACRO(5),  KEY(F14),  KEY(F15),         ___,          ___,
     ___,         KEY(F1),   KEY(F2),   KEY(F3),      KEY(F4),     KEY(F5),
-    ___,         ___,       ___,          ___,         ___,          ___,
-    ___,         ___,       ___,          ___,         ___,          ___,
-    ___,         ___,       ___,          ___,         ___,          ___,
+    ___,         ___,       MMOVE(WHEEL_UP), MMOVE(UP), MMOVE(WHEEL_DOWN), ___,
+    ___,         ___,       MMOVE(LEFT),  MMOVE(DOWN), MMOVE(RIGHT), ___,
+    ___,         ___,       MBTN(LEFT),   MBTN(MIDDLE), MBTN(RIGHT), ___,
     ___,         ___,       ___,          ___,         ___,          ___,
     ___,         ___,       ___,          ___,         ___,          ___,
 
@@ -178,19 +300,38 @@ const action_t keymap[2][84] = {
     KEY(F6),   KEY(F7),     KEY(F8),     KEY(F9),   KEY(F10),     ___,
     ___,         ___,       ___,          ___,         ___,       ___,
     ___,         ___,       ___,          ___,         ___,       ___,
-    ___,         ___,       CONS(SCAN_PREVIOUS_TRACK), CONS(SCAN_PREVIOUS_TRACK), CONS(PLAY),       ___,
+    ___,         ___,       CONS(SCAN_PREVIOUS_TRACK), CONS(SCAN_NEXT_TRACK), CONS(PLAY_SLASH_PAUSE),       ___,
     ___,         ___,       ___,          ___,         KEY(PAGE_UP),   ___,
     ___,         ___,       ___,          KEY(HOME),   KEY(PAGE_DOWN), KEY(END)
   )
 };
 
+static constexpr uint8_t kNumLayers = sizeof(keymap) / sizeof(keymap[0]);
+
+// The keymap that actions are resolved through: the one above,
+// unless hotswap.h has loaded another in its place
+static const action_t (*activeKeymap)[matrix_t::kKeys] = keymap;
+static uint8_t activeLayers = kNumLayers;
+
+// Returns a bitmap of the layers currently on the stack
+static uint8_t layerBitmap() {
+  uint8_t bits = 0;
+  for (int s = 0; s <= layer_pos; ++s) {
+    bits |= 1 << layer_stack[s];
+  }
+  return bits;
+}
+
 static uint32_t resolveActionForScanCodeOnActiveLayer(uint8_t scanCode) {
   int s = layer_pos;
 
-  while (s >= 0 && keymap[layer_stack[s]][scanCode] == ___) {
+  // A layer pushed before a swap to a keymap without it reads as
+  // transparent until it is popped
+  while (s >= 0 && (layer_stack[s] >= activeLayers ||
+                    activeKeymap[layer_stack[s]][scanCode] == ___)) {
     --s;
   }
-  return keymap[layer_stack[s]][scanCode];
+  return s >= 0 ? activeKeymap[layer_stack[s]][scanCode] : ___;
 }
 
 void performMacro(uint8_t n) {
@@ -198,154 +339,318 @@ void performMacro(uint8_t n) {
     case 0:
       // enterSerialDfu();
       return;
+    case 1:
+      requestTraceDump();
+      return;
+    case 2:
+      requestTraceReplay();
+      return;
+    case 3:
+      requestSyntheticReplay();
+      return;
+    case 4:
+      requestPropertyCheck();
+      return;
+    case 5:
+      requestUsageDump();
+      return;
   }
 }
 
-void applyMatrix() {
-  bool keysChanged = false;
+static void queueMacro(uint8_t n) {
+  if (numPendingMacros < sizeof(pendingMacros)) {
+    pendingMacros[numPendingMacros++] = n;
+  }
+}
 
-  auto down = readMatrix();
-  auto now = millis();
+void runPendingMacros() {
+  for (uint8_t i = 0; i < numPendingMacros; ++i) {
+    performMacro(pendingMacros[i]);
+  }
+  numPendingMacros = 0;
+}
 
-  for (int rowNum = 0; rowNum < 6; ++rowNum) {
-    for (int colNum = 0; colNum < 14; ++colNum) {
-      auto scanCode = (rowNum * 14) + colNum;
-      auto isDown = down.rows[rowNum] & (1 << colNum);
-      auto wasDown = lastRead.rows[rowNum] & (1 << colNum);
+// Actions are handled through a table indexed by opcode, so that
+// handling a key is a single indexed call rather than a chain of
+// branches.  Each opcode has a handler for the press and for the
+// release of a key bound to it, and one that adds a held key to
+// the report.  The table is generated at compile time from the
+// keymap: opcodes that it doesn't use get the no-op handlers, so
+// that their code drops out of the binary.  With HOTSWAP set a
+// loaded keymap may use any of them, so all are kept.
+
+// The state of the pass that the handlers may update
+struct keypass_t {
+  uint16_t keyNow;
+  slotmask_t tapped; // tap-hold keys released within the interval
+};
 
-      if (isDown == wasDown) {
-        continue;
-      }
+struct reportbuilder_t {
+  KeyReport report;
+  uint8_t repsize;
+};
+
+typedef void (*keyhandler_t)(uint8_t slot, action_t action, keypass_t &pass);
+typedef void (*reporthandler_t)(action_t action, reportbuilder_t &b);
+
+struct opcodehandlers_t {
+  keyhandler_t transition[2]; // indexed by isDown
+  reporthandler_t report;     // for a key that is held
+};
+
+static void ignoreKey(uint8_t, action_t, keypass_t &) {}
+static void ignoreReport(action_t, reportbuilder_t &) {}
+
+// Keys left out of a report because it already held six; the
+// property checks in replay.h hold the engine to this
+static uint32_t reportOverflows = 0;
+
+static void reportKey(uint8_t key, reportbuilder_t &b) {
+  if (key == 0) {
+    return;
+  }
+  if (b.repsize < 6) {
+    b.report.keys[b.repsize++] = key;
+  } else {
+    ++reportOverflows;
+  }
+}
+
+// A press that finds the stack full pushes nothing, so its release
+// must not pop the layer of another key that is still held
+static void pushLayer(uint8_t slot, action_t action, keypass_t &) {
+  if (layer_pos + 1 < sizeof(layer_stack)) {
+    layer_stack[++layer_pos] = action & 0xff;
+    keyStates.pushedLayer |= 1u << slot;
+  }
+}
+
+static void popLayer(uint8_t slot, action_t, keypass_t &) {
+  slotmask_t bit = 1u << slot;
+  if ((keyStates.pushedLayer & bit) && layer_pos > 0) {
+    --layer_pos;
+  }
+  keyStates.pushedLayer &= ~bit;
+}
+
+static void releaseTapHold(uint8_t slot, action_t, keypass_t &pass) {
+  if (uint16_t(pass.keyNow - keyStates.priorChange[slot]) <= kTapTicks) {
+    // Released within the tap interval
+    pass.tapped |= 1u << slot;
+  }
+}
+
+static void pressMacro(uint8_t, action_t action, keypass_t &) {
+  // Macros fire once, on the press
+  queueMacro(action & 0xff);
+}
+
+static void reportKeyPress(action_t action, reportbuilder_t &b) {
+  reportKey(action & 0xff, b);
+}
+
+static void reportModifier(action_t action, reportbuilder_t &b) {
+  b.report.modifiers |= action & 0xff;
+}
+
+static void reportToggleMod(action_t action, reportbuilder_t &b) {
+  b.report.modifiers ^= action & 0xff;
+}
+
+static void reportTapHold(action_t action, reportbuilder_t &b) {
+  // Holding
+  b.report.modifiers |= (action >> 16) & 0xff;
+}
+
+static void reportKeyAndMod(action_t action, reportbuilder_t &b) {
+  b.report.modifiers |= (action >> 16) & 0xff;
+  reportKey(action & 0xff, b);
+}
+
+static constexpr uint8_t kNumOpcodes = (kMask >> 8) + 1;
+static constexpr uint16_t kKeymapSize = sizeof(keymap) / sizeof(action_t);
+
+static constexpr uint8_t opcodeIndex(action_t action) {
+  return (action & kMask) >> 8;
+}
+
+// true if any layer of the keymap binds a key to opcode
+static constexpr bool keymapUses(action_t opcode, uint16_t i = 0) {
+  return i < kKeymapSize &&
+         ((keymap[i / matrix_t::kKeys][i % matrix_t::kKeys] & kMask) ==
+              opcode ||
+          keymapUses(opcode, i + 1));
+}
+
+static constexpr opcodehandlers_t kIgnoreOpcode = {{ignoreKey, ignoreKey},
+                                                   ignoreReport};
+
+static constexpr opcodehandlers_t ifUsed(action_t opcode,
+                                         opcodehandlers_t handlers) {
+  return HOTSWAP || keymapUses(opcode) ? handlers : kIgnoreOpcode;
+}
+
+// Indexed by opcodeIndex(); the static_asserts below keep each
+// entry at its opcode.  Mouse and media keys are handled by their
+// own reports, outside this table, and that code is always compiled
+// in; ifUsed() drops only the keyboard opcodes that no layer binds.
+static constexpr opcodehandlers_t kOpcodeHandlers[kNumOpcodes] = {
+  kIgnoreOpcode, // ___
+  ifUsed(kKeyPress, {{ignoreKey, ignoreKey}, reportKeyPress}),
+  ifUsed(kModifier, {{ignoreKey, ignoreKey}, reportModifier}),
+  ifUsed(kLayer, {{popLayer, pushLayer}, ignoreReport}),
+  ifUsed(kTapHold, {{releaseTapHold, ignoreKey}, reportTapHold}),
+  ifUsed(kToggleMod, {{ignoreKey, ignoreKey}, reportToggleMod}),
+  ifUsed(kKeyAndMod, {{ignoreKey, ignoreKey}, reportKeyAndMod}),
+  kIgnoreOpcode, // kMouseButton
+  ifUsed(kMacro, {{ignoreKey, pressMacro}, ignoreReport}),
+  kIgnoreOpcode, // kConsumer
+  kIgnoreOpcode, // kMouseMove
+  kIgnoreOpcode,
+  kIgnoreOpcode,
+  kIgnoreOpcode,
+  kIgnoreOpcode,
+  kIgnoreOpcode,
+};
+static_assert(opcodeIndex(kKeyPress) == 1 && opcodeIndex(kModifier) == 2 &&
+                  opcodeIndex(kLayer) == 3 && opcodeIndex(kTapHold) == 4 &&
+                  opcodeIndex(kToggleMod) == 5 &&
+                  opcodeIndex(kKeyAndMod) == 6 &&
+                  opcodeIndex(kMouseButton) == 7 &&
+                  opcodeIndex(kMacro) == 8 && opcodeIndex(kConsumer) == 9 &&
+                  opcodeIndex(kMouseMove) == 10,
+              "kOpcodeHandlers must list the opcodes in order");
+
+// Runs the keymap engine over a matrix state observed at time now,
+// and sends a report if anything changed.
+// Returns true if the key state changed during this pass.
+bool processMatrix(const matrix_t &down, usec_t now) {
+  bool keysChanged = false;
+  // false if only mouse or media keys changed
+  bool keyboardChanged = false;
+  INSTR_TIMESTAMP(applyStart);
+  traceBeginPass();
+  keypass_t pass = {keyTime(now), 0};
+  auto keyNow = pass.keyNow;
+
+  matrix_t::forEachRow([&](uint8_t rowNum) {
+    // Visit just the keys that changed, in column order
+    for (auto changed = matrix_t::row_t(down.rows[rowNum] ^
+                                        lastRead.rows[rowNum]);
+         changed; changed &= changed - 1) {
+      uint8_t colNum = __builtin_ctz(changed);
+      uint8_t scanCode = matrix_t::scanCode(rowNum, colNum);
+      bool isDown = down.rows[rowNum] & matrix_t::bit(colNum);
       keysChanged = true;
 
-      auto state = stateSlot(scanCode, now);
-      if (isDown && !state) {
+      auto slot = stateSlot(scanCode, keyNow);
+      if (isDown && slot == kNoSlot) {
         // Silently drop this key; we're tracking too many
         // other keys right now
+        INSTR_COUNT(kCountDroppedKeys);
+        traceKeyEvent(scanCode, true, kTraceNoSlot, 0, layerBitmap(), now);
+        keyboardChanged = true;
         continue;
       }
-      //printState(state);
+      if (!isDown &&
+          (slot == kNoSlot || keyStates.scanCode[slot] != scanCode)) {
+        // Release of a key that we dropped; don't claim a slot for
+        // it, as we'd act on the stale action of its prior owner
+        traceKeyEvent(scanCode, false, kTraceNoSlot, 0, layerBitmap(), now);
+        keyboardChanged = true;
+        continue;
+      }
+      logState(slot);
 
+      slotmask_t bit = 1u << slot;
       bool isTransition = false;
-
-      if (state) {
-        if (state->scanCode == scanCode) {
-          // Update the transition time, if any
-          if (state->down != isDown) {
-            state->priorChange = state->lastChange;
-            state->lastChange = now;
-            state->down = isDown;
-            if (isDown) {
-              state->action = resolveActionForScanCodeOnActiveLayer(scanCode);
-            }
-            isTransition = true;
-          }
-        } else {
-          // We claimed a new slot, so set the transition
-          // time to the current time.
-          state->down = isDown;
-          state->scanCode = scanCode;
-          state->priorChange = now;
-          state->lastChange = now;
+      auto &action = keyStates.action[slot];
+
+      if (keyStates.scanCode[slot] == scanCode) {
+        // Update the transition time, if any
+        if (bool(keyStates.down & bit) != bool(isDown)) {
+          keyStates.priorChange[slot] = keyStates.lastChange[slot];
+          keyStates.lastChange[slot] = keyNow;
+          keyStates.down ^= bit;
           if (isDown) {
-            state->action = resolveActionForScanCodeOnActiveLayer(scanCode);
+            action = resolveActionForScanCodeOnActiveLayer(scanCode);
           }
           isTransition = true;
         }
+      } else {
+        // We claimed a new slot, so set the transition
+        // time to the current time.  Only presses get here.
+        keyStates.used |= bit;
+        keyStates.down |= bit;
+        keyStates.scanCode[slot] = scanCode;
+        keyStates.priorChange[slot] = keyNow;
+        keyStates.lastChange[slot] = keyNow;
+        action = resolveActionForScanCodeOnActiveLayer(scanCode);
+        isTransition = true;
+      }
 
-        if (isTransition) {
-          switch (state->action & kMask) {
-            case kLayer:
-              if (state->down) {
-                // Push the new layer stack position
-                layer_stack[++layer_pos] = state->action & 0xff;
-              } else {
-                // Pop off the layer stack
-                --layer_pos;
-              }
-              break;
-          }
+      if (!isTransition || !hasOwnReport(action)) {
+        keyboardChanged = true;
+      }
+      if (isTransition) {
+        INSTR_COUNT(kCountKeyEvents);
+        traceKeyEvent(scanCode, isDown, slot, action, layerBitmap(), now);
+        if (isDown) {
+          usageCountPress(scanCode);
         }
+        kOpcodeHandlers[opcodeIndex(action)].transition[isDown](slot, action,
+                                                                pass);
       }
     }
-  }
+  });
 
-  if (keysChanged || last_was_tap) {
-    KeyReport report;
-    memset(&report, 0, sizeof(report));
-    uint8_t repsize = 0;
-    uint8_t mods = 0;
-    uint8_t mouseButtons = 0;
+  if (keyboardChanged || last_was_tap) {
+    reportbuilder_t b;
+    memset(&b, 0, sizeof(b));
     last_was_tap = false;
 
-    for (auto &state: keyStates) {
-      if (state.scanCode != 0xff && state.down) {
-        switch (state.action & kMask) {
-          case kTapHold:
-            // Holding
-            mods |= (state.action >> 16) & 0xff;
-            break;
-          case kKeyAndMod:
-            {
-              mods |= (state.action >> 16) & 0xff;
-              auto key = state.action & 0xff;
-              if (key != 0 && repsize < 6) {
-                report.keys[repsize++] = key;
-              }
-            }
-            break;
-          case kKeyPress:
-            {
-              auto key = state.action & 0xff;
-              if (key != 0 && repsize < 6) {
-                report.keys[repsize++] = key;
-              }
-            }
-            break;
-          case kModifier:
-            mods |= state.action & 0xff;
-            break;
-          case kToggleMod:
-            mods ^= state.action & 0xff;
-            break;
-
-          case kMacro:
-            performMacro(state.action & 0xff);
-            break;
-        }
-      } else if (state.scanCode != 0xff && !state.down) {
-        switch (state.action & kMask) {
-          case kTapHold:
-            if (state.lastChange == now && state.lastChange - state.priorChange <= kTapInterval) {
-              // Tapped and just released.  FIXME: suppress this if we generated a
-              // report with the hold portion of this together with another key?
-              auto key = state.action & 0xff;
-              if (key != 0 && repsize < 6) {
-                report.keys[repsize++] = key;
-                last_was_tap = true;
-              }
-            }
-            break;
+    for (slotmask_t live = keyStates.down | pass.tapped; live;
+         live &= live - 1) {
+      uint8_t slot = __builtin_ctz(live);
+      auto action = keyStates.action[slot];
+      if (keyStates.down & (1u << slot)) {
+        kOpcodeHandlers[opcodeIndex(action)].report(action, b);
+      } else {
+        // Tapped and just released.  FIXME: suppress this if we generated a
+        // report with the hold portion of this together with another key?
+        auto repsize = b.repsize;
+        reportKey(action & 0xff, b);
+        if (b.repsize != repsize) {
+          last_was_tap = true;
         }
       }
     }
 
-    // HID().mouseButtonPress(mouseButtons);
+    LOG_INFO(KEYMAP, kLogReport, b.report.modifiers, b.repsize,
+             b.report.keys[0], b.report.keys[1], b.report.keys[2],
+             b.report.keys[3], b.report.keys[4], b.report.keys[5]);
 
-#if WAT
-    Serial.print("mods=");
-    Serial.print(mods, HEX);
-    Serial.print(" repsize=");
-    Serial.print(repsize);
-    for (int i = 0; i < repsize; i++) {
-      Serial.print(" ");
-      Serial.print(report.keys[i], HEX);
-    }
-    Serial.print("\r\n");
-#endif
+    reportSink(&b.report);
+    traceReportSent(b.report);
+    INSTR_RECORD(kHistScanToReport, applyStart);
+    INSTR_COUNT(kCountReports);
+  }
 
-    report.modifiers = mods;
-    Keyboard.sendReport(&report);
+  if (keysChanged) {
+    uint16_t consumer = 0;
+    for (slotmask_t live = keyStates.down; live; live &= live - 1) {
+      auto action = keyStates.action[__builtin_ctz(live)];
+      if ((action & kMask) == kConsumer) {
+        consumer = action >> 16;
+        break;
+      }
+    }
+    if (consumer != lastConsumer) {
+      lastConsumer = consumer;
+      ConsumerReport report = {consumer};
+      consumerSink(&report);
+    }
     lastRead = down;
   }
+  return keysChanged;
 }
@@ -4,8 +4,9 @@
 // This file holds the code that scans the keyboard matrix.
 // It uses an SX1509 IO expander to read the matrix for the
 // right hand side and an Adafruit Feather M0 for the left
-// hand side.  The readMatrix() function is the main function
-// of interest.
+// hand side.  More expanders can share the I2C bus to scan
+// extra clusters.  The readMatrix() function is the main
+// function of interest.
 
 // NOTE: if you change the row or column mappings here, you
 // will probably also need to change the KEYMAP macro defined
@@ -23,17 +24,304 @@ static const int rowPins[] = {14,15,16,17,18,19};
 static const int expColPins[] = {8,9,10,11,12,13,14};
 static const int expRowPins[] = {0,1,2,3,4,5};
 
-static struct matrix_t debounceMatrix;
-static struct matrix_t localMatrix;
-static constexpr int kDebounceIterations = 1;
-static int debouncing = kDebounceIterations;
-static SX1509 expander;
+// The expanders on the bus.  Each drives the rows from bank A
+// and reads the columns wired to bank B, which land in the
+// matrix starting at colOffset.  Give each one its own address.
+struct expanderconfig_t {
+  uint8_t address;
+  uint8_t colMask;   // bank B pins wired to columns
+  uint8_t colOffset; // matrix column of bank B pin 0
+};
+static constexpr struct expanderconfig_t expanderConfigs[] = {
+  {SX1509::kDefaultAddress, 0b01111111, 7},
+};
+static constexpr uint8_t kNumExpanders =
+    sizeof(expanderConfigs) / sizeof(expanderConfigs[0]);
 
+static constexpr uint8_t maskWidth(uint8_t mask) {
+  return mask ? 1 + maskWidth(mask >> 1) : 0;
+}
+// Checks that every expander's columns fit in the matrix
+static constexpr bool expandersFit(uint8_t i = 0) {
+  return i == kNumExpanders ||
+         (expanderConfigs[i].colOffset +
+                  maskWidth(expanderConfigs[i].colMask) <=
+              matrix_t::kCols &&
+          expandersFit(i + 1));
+}
+static_assert(expandersFit(), "expander columns must fit in the matrix");
+static_assert(sizeof(rowPins) / sizeof(rowPins[0]) == matrix_t::kRows,
+              "there must be a row pin for every matrix row");
+static_assert(sizeof(colPins) / sizeof(colPins[0]) <= matrix_t::kCols,
+              "local columns must fit in the matrix");
+static_assert(kNumExpanders <= kInstrMaxDevices,
+              "expander stats must fit in a single page");
+
+static matrix_t debounceMatrix;
+static matrix_t localMatrix;
+// How long the raw matrix must be stable before we accept it;
+// 0 accepts a change as soon as it is seen.
+static constexpr uint32_t kDebounceTime = 0; // microseconds
+static bool debouncing = false;
+static usec_t lastRawChange;
+#if INSTRUMENT
+static uint32_t debounceStart;
+#endif
+
+// If an expander stops responding (the cable between the halves
+// is loose, say) we stop talking to it and scan without it, so
+// that a dead right hand doesn't slow down the live one.
+// Meanwhile we periodically recover the bus and try to restart it,
+// backing off exponentially while it stays down.
+// How many consecutive errors take an expander offline
+static constexpr uint8_t kExpanderFailureLimit = 3;
+// The first retry interval; it doubles up to kExpanderRetryMax
+static constexpr uint32_t kExpanderRetryMin = 10000; // microseconds
+static constexpr uint32_t kExpanderRetryMax = 5000000; // microseconds
+
+struct expanderstate_t {
+  SX1509 device;
+  bool up;
+  uint8_t failures;
+  uint32_t retryInterval;
+  usec_t retryAt;
+};
+static struct expanderstate_t expanders[kNumExpanders];
+
+// The columns are pulled up weakly, so after a row with a pressed
+// key is released they take a while to rise again; we must not read
+// the next row until they have.  Rather than waiting for a fixed
+// time we measure this at boot, per row, and wait for the measured
+// time plus a safety margin.
+// kDefaultSettle is the fixed wait that we used to use and the
+// fallback until calibration has run.
+static constexpr uint8_t kDefaultSettle = 25; // microseconds
+// How long calibration waits for a column to rise.  Any that don't
+// are held low by a pressed key and are left out of the measurement.
+static constexpr uint32_t kCalibrationTimeout = 500; // microseconds
+// How often to calibrate again while idle, or 0 to only do it at boot
+static constexpr usec_t kRecalibrateInterval = 600000000; // microseconds
+
+struct rowsettle_t {
+  // Time to wait after the strobe before reading the expanders,
+  // beyond the time it takes for the first read to reach them
+  uint8_t expander;
+  // Time to wait after the strobe before reading the local columns
+  uint8_t local;
+};
+static struct rowsettle_t rowSettle[sizeof(rowPins) / sizeof(rowPins[0])];
+static usec_t lastCalibration;
+static bool calibrated = false;
+
+static uint8_t withSettleMargin(uint32_t measured) {
+  auto settle = measured * 2 + 2;
+  return settle > 0xff ? 0xff : settle;
+}
+
+// Holds the local columns low, then releases them and measures
+// how long they take to read high again
+static uint32_t measureLocalColumnRise() {
+  for (const auto &pin : colPins) {
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, LOW);
+  }
+  auto start = micros();
+  for (const auto &pin : colPins) {
+    pinMode(pin, INPUT_PULLUP);
+  }
+
+  uint8_t pending = (1 << (sizeof(colPins) / sizeof(colPins[0]))) - 1;
+  uint32_t settled = 0;
+  uint32_t elapsed;
+  while (pending && (elapsed = micros() - start) < kCalibrationTimeout) {
+    for (int colNum = 0; colNum < sizeof(colPins) / sizeof(colPins[0]);
+         ++colNum) {
+      if ((pending & (1 << colNum)) && digitalRead(colPins[colNum])) {
+        pending &= ~(1 << colNum);
+        settled = elapsed;
+      }
+    }
+  }
+  return settled;
+}
+
+// As measureLocalColumnRise(), but for an expander's columns.
+// Reads take a whole I2C transaction, so we report how much
+// longer than the first read it took for them to read high.
+static uint32_t measureExpanderColumnRise(SX1509 &expander,
+                                          uint8_t colMask) {
+  expander.dataB(0);
+  expander.directionB(0);
+  expander.directionB(colMask);
+  auto start = micros();
+
+  uint8_t pending = colMask;
+  uint32_t firstRead = 0;
+  uint32_t settled = 0;
+  uint32_t elapsed;
+  uint8_t bits;
+  while (pending && (elapsed = micros() - start) < kCalibrationTimeout) {
+    if (!expander.readDataB(bits)) {
+      return 0;
+    }
+    if (!firstRead) {
+      firstRead = micros() - start;
+    }
+    if (pending & bits) {
+      pending &= ~bits;
+      settled = micros() - start - firstRead;
+    }
+  }
+  return settled;
+}
+
+// Measures the settle time for each row, taking the slowest of
+// the expanders.  The expander rows keep their previous settle
+// time while they are all offline.
+void calibrateKeyScanner() {
+  for (int rowNum = 0; rowNum < sizeof(rowPins) / sizeof(rowPins[0]);
+       ++rowNum) {
+    for (auto &e : expanders) {
+      if (e.up) {
+        e.device.dataA(~(1<<rowNum));
+      }
+    }
+    digitalWrite(rowPins[rowNum], LOW);
+
+    rowSettle[rowNum].local = withSettleMargin(measureLocalColumnRise());
+    uint32_t expanderRise = 0;
+    bool anyUp = false;
+    for (uint8_t i = 0; i < kNumExpanders; ++i) {
+      if (expanders[i].up) {
+        auto rise = measureExpanderColumnRise(expanders[i].device,
+                                              expanderConfigs[i].colMask);
+        if (rise > expanderRise) {
+          expanderRise = rise;
+        }
+        anyUp = true;
+      }
+    }
+    if (anyUp) {
+      rowSettle[rowNum].expander = withSettleMargin(expanderRise);
+    }
+
+    digitalWrite(rowPins[rowNum], HIGH);
+  }
+  for (auto &e : expanders) {
+    if (e.up) {
+      e.device.dataA(0b00111111);
+    }
+  }
+  lastCalibration = nowMicros();
+  calibrated = true;
+}
+
+// Called while idle; calibrates for the first time after boot, or
+// again if it is due
+void maybeRecalibrateKeyScanner() {
+  if (!calibrated || (kRecalibrateInterval &&
+                      nowMicros() - lastCalibration >= kRecalibrateInterval)) {
+    calibrateKeyScanner();
+  }
+}
+
+// Waits until settle microseconds have passed since strobeTime,
+// returning how long we actually waited
+static uint32_t settleSince(uint32_t strobeTime, uint8_t settle) {
+  auto elapsed = micros() - strobeTime;
+  if (elapsed >= settle) {
+    return 0;
+  }
+  while (micros() - strobeTime < settle) {
+  }
+  return settle - elapsed;
+}
+
+// Configures the pins of an expander that has just been reset
+// for scanning; returns false if it didn't respond
+static bool configureExpander(SX1509 &expander, uint8_t colMask) {
+  return expander.checkReset() &&
+         // 0 is output
+         expander.directionA(0b11000000) &&
+         // 1 is high
+         expander.dataA(0b00111111) &&
+         // 1 is input
+         expander.directionB(colMask) &&
+         // 1 is pull up enabled
+         expander.pullupB(colMask);
+}
+
+// Resets an expander and configures its pins for scanning
+static bool startExpander(SX1509 &expander, uint8_t colMask) {
+  expander.softwareReset();
+  return configureExpander(expander, colMask);
+}
+
+static void scheduleExpanderRetry(struct expanderstate_t &e, usec_t now) {
+  e.retryAt = now + e.retryInterval;
+  e.retryInterval *= 2;
+  if (e.retryInterval > kExpanderRetryMax) {
+    e.retryInterval = kExpanderRetryMax;
+  }
+}
+
+// Called when an expander operation fails
+static void expanderFailed(struct expanderstate_t &e, usec_t now) {
+  INSTR_COUNT(kCountI2CErrors);
+  if (++e.failures >= kExpanderFailureLimit) {
+    e.up = false;
+    e.retryInterval = kExpanderRetryMin;
+    scheduleExpanderRetry(e, now);
+    INSTR_COUNT(kCountExpanderOffline);
+    LOG_WARN(SCANNER, kLogExpanderOffline, &e - expanders, e.failures);
+  }
+}
+
+// Called before each scan; tries to bring offline expanders
+// back if a retry is due.  The bus is shared, so we recover
+// it at most once per scan.
+static void serviceExpanders(usec_t now) {
+  bool recovered = false;
+  for (uint8_t i = 0; i < kNumExpanders; ++i) {
+    auto &e = expanders[i];
+    if (e.up || now < e.retryAt) {
+      continue;
+    }
+    INSTR_COUNT(kCountExpanderRetries);
+    if (!recovered) {
+      SX1509::recoverBus();
+      recovered = true;
+    }
+    if (startExpander(e.device, expanderConfigs[i].colMask)) {
+      e.up = true;
+      e.failures = 0;
+      LOG_INFO(SCANNER, kLogExpanderBack, i);
+    } else {
+      scheduleExpanderRetry(e, now);
+    }
+  }
+}
+
+// Called once, from setup().  We start the expander resets first
+// and set up the local pins while they complete.  Calibration is
+// left to the first idle pass so that scanning starts straight
+// away; until then every row waits kDefaultSettle.
 void initKeyScanner() {
-  expander.init();
+  Wire.begin();
+  for (uint8_t i = 0; i < kNumExpanders; ++i) {
+    auto &e = expanders[i];
+    e.device = SX1509(expanderConfigs[i].address);
+    e.failures = 0;
+    e.retryInterval = kExpanderRetryMin;
+    e.device.softwareReset();
+  }
+  for (auto &settle : rowSettle) {
+    settle.expander = kDefaultSettle;
+    settle.local = kDefaultSettle;
+  }
   memset(&debounceMatrix, 0, sizeof(debounceMatrix));
   memset(&localMatrix, 0, sizeof(localMatrix));
-  debouncing = kDebounceIterations;
+  debouncing = false;
 
   // Set all the rows to output-high
   for (const auto &pin : rowPins) {
@@ -41,69 +329,112 @@ void initKeyScanner() {
     digitalWrite(pin, HIGH);
   }
 
-  // 0 is output
-  expander.directionA(0b11000000);
-  // 1 is high
-  expander.dataA(0b00111111);
-
   // Set all the columns to input-pullup
   for (const auto &pin : colPins) {
     pinMode(pin, INPUT_PULLUP);
   }
 
-  // 1 is input
-  expander.directionB(0b01111111);
-  // 1 is pull up enabled
-  expander.pullupB(0b01111111);
+  for (uint8_t i = 0; i < kNumExpanders; ++i) {
+    auto &e = expanders[i];
+    e.up = configureExpander(e.device, expanderConfigs[i].colMask);
+    if (!e.up) {
+      scheduleExpanderRetry(e, nowMicros());
+    }
+  }
+  calibrated = false;
 }
 
 void scanMatrix() {
+  INSTR_TIMESTAMP(instrScanStart);
+  auto scanTime = nowMicros();
+  serviceExpanders(scanTime);
   for (int rowNum = 0; rowNum < sizeof(rowPins) / sizeof(rowPins[0]);
        ++rowNum) {
-    // Set just this row to LOW in the expander; the rest are set HIGH
-    expander.dataA(~(1<<rowNum));
+    // Set just this row to LOW in every expander; the rest are set
+    // HIGH.  We strobe them all before reading any of them, so that
+    // each settles while we talk to the ones before it and the bus
+    // time grows by just one write and one read per expander.
+    uint8_t strobed = 0;
+    for (uint8_t i = 0; i < kNumExpanders; ++i) {
+      if (expanders[i].up && expanders[i].device.dataA(~(1<<rowNum))) {
+        strobed |= 1 << i;
+      }
+    }
     digitalWrite(rowPins[rowNum], LOW);
-    delayMicroseconds(25);
+    auto strobeTime = micros();
 
-    uint16_t rowBits = 0;
-    uint8_t expanderBits;
+    matrix_t::row_t rowBits = 0;
+    uint32_t waited = 0;
+    if (strobed) {
+      waited = settleSince(strobeTime, rowSettle[rowNum].expander);
+    }
 
-    // Read all the columns from the expander in a single IO op
-    if (!expander.readDataB(expanderBits)) {
-      // Pretend that they are all high if there is a comms error
-      expanderBits = 0xff;
+    for (uint8_t i = 0; i < kNumExpanders; ++i) {
+      auto &e = expanders[i];
+      const auto &config = expanderConfigs[i];
+      if (!e.up) {
+        // Treat its columns as all high while it is offline
+        continue;
+      }
+      uint8_t expanderBits;
+      bool expanderOk = strobed & (1 << i);
+      if (expanderOk) {
+        // Read all of its columns in a single IO op.  This takes
+        // long enough that the local columns have usually settled
+        // by the time that the reads complete.
+        INSTR_TIMESTAMP(readStart);
+        expanderOk = e.device.readDataB(expanderBits);
+        INSTR_DEVICE_READ(i, readStart, expanderOk);
+      }
+      if (expanderOk) {
+        e.failures = 0;
+      } else {
+        expanderFailed(e, scanTime);
+        // Hold the previous state across a transient error rather
+        // than releasing every key on that side
+        expanderBits = e.up ? ~(debounceMatrix.rows[rowNum] >> config.colOffset)
+                            : 0xff;
+      }
+      rowBits |= matrix_t::row_t(~expanderBits & config.colMask)
+                 << config.colOffset;
     }
+    waited += settleSince(strobeTime, rowSettle[rowNum].local);
+    INSTR_ADD(kCountSettleSaved,
+              waited < kDefaultSettle ? kDefaultSettle - waited : 0);
 
     for (int colNum = 0; colNum < sizeof(colPins) / sizeof(colPins[0]);
          ++colNum) {
       if (!digitalRead(colPins[colNum])) {
-        rowBits |= 1 << (colNum);
-      }
-      if ((expanderBits & (1<<colNum)) == 0) {
-        rowBits |= 1 << (colNum + 7);
+        rowBits |= matrix_t::bit(colNum);
       }
     }
 
     if (rowBits != debounceMatrix.rows[rowNum]) {
-      // Switch status changed, reset the debounce counter
-      debouncing = kDebounceIterations;
+      // Switch status changed, restart the debounce interval
+      if (!debouncing) {
+        INSTR_MARK(debounceStart);
+      }
+      INSTR_COUNT(kCountDebounceResets);
+      chatterRow(rowNum, debounceMatrix.rows[rowNum], rowBits, scanTime);
+      debouncing = true;
+      lastRawChange = scanTime;
       debounceMatrix.rows[rowNum] = rowBits;
     }
 
     digitalWrite(rowPins[rowNum], HIGH);
   }
+  INSTR_RECORD(kHistScan, instrScanStart);
+  INSTR_COUNT(kCountScans);
 
-  if (debouncing) {
-    if (--debouncing) {
-      delay(1);
-    } else {
-      // We got a stable result, transfer the data to the matrix
-      localMatrix = debounceMatrix;
-    }
+  if (debouncing && nowMicros() - lastRawChange >= kDebounceTime) {
+    // We got a stable result, transfer the data to the matrix
+    debouncing = false;
+    localMatrix = debounceMatrix;
+    INSTR_RECORD(kHistDebounce, debounceStart);
   }
 }
 
-struct matrix_t readMatrix() {
+matrix_t readMatrix() {
   scanMatrix();
   return localMatrix;
 }
@@ -0,0 +1,151 @@
+#pragma once
+// This file holds the deferred log.
+// Set LOG to 1 in Spockduino.ino to record log messages into a
+// ring buffer in RAM.  A message is only its ID and its arguments
+// as raw 32 bit words, so logging one costs a handful of stores and
+// never waits on a port; nothing is formatted on the keyboard.  The
+// ring is sent to the host in an idle pass over the vendor
+// diagnostics report, and tools/spock-log.py formats it using the
+// format strings in LOG_MESSAGES below, which it reads from this
+// file.  The strings themselves are never compiled in.
+// Each module has a log level; a message above its module's level,
+// or any message with LOG set to 0, compiles to nothing.
+
+#ifndef LOG
+#define LOG 0
+#endif
+
+enum LogLevel : uint8_t {
+  kLogOff,
+  kLogError,
+  kLogWarn,
+  kLogInfo,
+  kLogDebug,
+};
+
+// The levels of the modules, which Spockduino.ino can override
+#ifndef LOG_LEVEL_KEYMAP
+#define LOG_LEVEL_KEYMAP kLogInfo
+#endif
+#ifndef LOG_LEVEL_SCANNER
+#define LOG_LEVEL_SCANNER kLogWarn
+#endif
+#ifndef LOG_LEVEL_HOTSWAP
+#define LOG_LEVEL_HOTSWAP kLogInfo
+#endif
+
+// The messages: their IDs and the printf formats that
+// tools/spock-log.py uses for them.  Every argument is a uint32_t.
+// Add new ones at the end, so that old logs still decode.
+#define LOG_MESSAGES(X)                                                    \
+  X(kLogDropped, "dropped %u messages")                                    \
+  X(kLogReport, "mods=%x repsize=%u keys=%x %x %x %x %x %x")               \
+  X(kLogKeyState, "scanCode=%x down=%u lastChange=%u action=%x")           \
+  X(kLogExpanderOffline, "expander %u offline after %u failures")          \
+  X(kLogExpanderBack, "expander %u back")                                  \
+  X(kLogKeymapLoaded, "keymap status %u layers=%u crc=%08x")
+
+#define LOG_ID(id, format) id,
+enum LogMessage : uint8_t { LOG_MESSAGES(LOG_ID) kNumLogMessages };
+#undef LOG_ID
+
+// A record is a header word, the low 32 bits of nowMicros(), and
+// then the arguments
+static constexpr uint8_t kLogMaxArgs = 13;
+static constexpr uint16_t kLogSize = 256; // words; must be a power of 2
+static constexpr uint8_t kLogWordsPerPage = sizeof(VendorReport::data) / 4;
+static_assert(2 + kLogMaxArgs <= kLogWordsPerPage,
+              "a record must fit in a report");
+
+static inline uint32_t logHeader(uint8_t id, uint8_t numArgs) {
+  return id | (numArgs << 8);
+}
+
+// Logs message id at the given level for a module, eg
+//   LOG_DEBUG(KEYMAP, kLogKeyState, scanCode, down, ...);
+// which compiles to nothing unless LOG_LEVEL_KEYMAP is kLogDebug
+#define LOG_AT(moduleLevel, level, id, ...) \
+  do {                                      \
+    if (LOG && (level) <= (moduleLevel)) {  \
+      logWrite(id, ##__VA_ARGS__);          \
+    }                                       \
+  } while (0)
+#define LOG_ERROR(module, id, ...) \
+  LOG_AT(LOG_LEVEL_##module, kLogError, id, ##__VA_ARGS__)
+#define LOG_WARN(module, id, ...) \
+  LOG_AT(LOG_LEVEL_##module, kLogWarn, id, ##__VA_ARGS__)
+#define LOG_INFO(module, id, ...) \
+  LOG_AT(LOG_LEVEL_##module, kLogInfo, id, ##__VA_ARGS__)
+#define LOG_DEBUG(module, id, ...) \
+  LOG_AT(LOG_LEVEL_##module, kLogDebug, id, ##__VA_ARGS__)
+
+#if LOG
+// One writer, the main loop, and one reader, flushLog(); the
+// writer only moves logHead and the reader only moves logTail, so
+// neither needs a lock.  When the ring is full new messages are
+// dropped and counted rather than overwriting ones not yet sent.
+static uint32_t logRing[kLogSize];
+static volatile uint16_t logHead = 0;
+static volatile uint16_t logTail = 0;
+static uint32_t logDropped = 0;
+static uint8_t logPage = 0;
+
+static void logRecord(uint8_t id, const uint32_t *args, uint8_t numArgs) {
+  uint16_t head = logHead;
+  if (uint16_t(kLogSize - (head - logTail)) < 2 + numArgs) {
+    ++logDropped;
+    return;
+  }
+  logRing[head++ & (kLogSize - 1)] = logHeader(id, numArgs);
+  logRing[head++ & (kLogSize - 1)] = uint32_t(nowMicros());
+  for (uint8_t i = 0; i < numArgs; ++i) {
+    logRing[head++ & (kLogSize - 1)] = args[i];
+  }
+  logHead = head;
+}
+
+template <typename... Args>
+inline void logWrite(LogMessage id, Args... args) {
+  static_assert(sizeof...(args) <= kLogMaxArgs, "too many log arguments");
+  // The leading 0 keeps the array from being empty
+  const uint32_t words[] = {0, uint32_t(args)...};
+  logRecord(id, words + 1, sizeof...(args));
+}
+
+// Called while idle; sends what has been logged since the last
+// call, whole records at a time.  report.index counts the pages
+// so that the host can tell if it missed one.
+void flushLog() {
+  VendorReport report;
+  report.kind = kVendorLog;
+  while (logTail != logHead) {
+    memset(report.data, 0, sizeof(report.data));
+    uint16_t tail = logTail;
+    uint8_t words = 0;
+    while (tail != logHead) {
+      uint8_t recordWords = 2 + (logRing[tail & (kLogSize - 1)] >> 8 & 0xff);
+      if (words + recordWords > kLogWordsPerPage) {
+        break;
+      }
+      for (uint8_t i = 0; i < recordWords; ++i, ++words) {
+        // report.data isn't word aligned, so copy rather than assign
+        memcpy(report.data + words * 4, &logRing[tail++ & (kLogSize - 1)],
+               sizeof(uint32_t));
+      }
+    }
+    report.index = logPage++;
+    Keyboard.sendVendorReport(&report);
+    logTail = tail;
+  }
+  // The ring is empty now, so this fits; it goes with the next flush
+  if (logDropped) {
+    auto dropped = logDropped;
+    logDropped = 0;
+    logWrite(kLogDropped, dropped);
+  }
+}
+#else
+template <typename... Args>
+inline void logWrite(LogMessage, Args...) {}
+void flushLog() {}
+#endif
@@ -0,0 +1,81 @@
+#pragma once
+// This file holds the key matrix representation.
+// Matrix<Rows, Cols> holds one bit per key, a row word per row,
+// where the row word is the narrowest unsigned type that has a bit
+// for every column.  Scan codes number the keys row by row.
+// The dimensions are template parameters so that each board gets
+// code specialized to its size: forEachRow() unrolls at compile
+// time, and nothing needs to check the dimensions at runtime.
+
+// The narrowest unsigned type with at least Cols bits
+template <uint8_t Cols, bool Byte = (Cols <= 8), bool Half = (Cols <= 16)>
+struct MatrixRow {
+  static_assert(Cols <= 32, "rows may have at most 32 columns");
+  typedef uint32_t type;
+};
+template <uint8_t Cols>
+struct MatrixRow<Cols, true, true> {
+  typedef uint8_t type;
+};
+template <uint8_t Cols>
+struct MatrixRow<Cols, false, true> {
+  typedef uint16_t type;
+};
+
+// Calls fn(row) for Row..Rows-1, unrolled
+template <uint8_t Row, uint8_t Rows>
+struct MatrixRowLoop {
+  template <typename Fn>
+  static inline void run(Fn &fn) {
+    fn(Row);
+    MatrixRowLoop<Row + 1, Rows>::run(fn);
+  }
+};
+template <uint8_t Rows>
+struct MatrixRowLoop<Rows, Rows> {
+  template <typename Fn>
+  static inline void run(Fn &) {}
+};
+
+template <uint8_t Rows, uint8_t Cols>
+struct Matrix {
+  typedef typename MatrixRow<Cols>::type row_t;
+  static constexpr uint8_t kRows = Rows;
+  static constexpr uint8_t kCols = Cols;
+  static constexpr uint16_t kKeys = Rows * Cols;
+
+  row_t rows[Rows];
+
+  static constexpr uint8_t scanCode(uint8_t row, uint8_t col) {
+    return row * Cols + col;
+  }
+
+  static constexpr row_t bit(uint8_t col) {
+    return row_t(1) << col;
+  }
+
+  bool isDown(uint8_t scanCode) const {
+    return rows[scanCode / Cols] & bit(scanCode % Cols);
+  }
+
+  void set(uint8_t scanCode, bool down) {
+    auto &row = rows[scanCode / Cols];
+    row = down ? row | bit(scanCode % Cols) : row & ~bit(scanCode % Cols);
+  }
+
+  void toggle(uint8_t scanCode) {
+    rows[scanCode / Cols] ^= bit(scanCode % Cols);
+  }
+
+  template <typename Fn>
+  static inline void forEachRow(Fn fn) {
+    MatrixRowLoop<0, Rows>::run(fn);
+  }
+
+  // true if any key is down
+  bool any() const {
+    row_t bits = 0;
+    forEachRow([&](uint8_t row) { bits |= rows[row]; });
+    return bits != 0;
+  }
+};
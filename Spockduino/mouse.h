@@ -0,0 +1,159 @@
+#pragma once
+// This file holds the mouse keys.
+// kMouseButton actions hold down mouse buttons and kMouseMove
+// actions move the pointer or the wheel for as long as they are
+// held.  updateMouse() runs after the keymap engine on every pass;
+// it integrates the motion over the whole USB frames that have
+// elapsed since the last pass and sends a mouse report when there
+// is anything to say.  While a mouse key is held the scan runs at
+// full rate, so this produces one report per frame.
+// Speeds are fixed point, in 1/256 of a count per frame, and
+// accelerate along a quadratic curve from the minimum to the
+// maximum over kMouseAccelFrames.  The fractions are carried from
+// frame to frame so that slow movement is smooth rather than
+// stuttering.
+
+static constexpr uint32_t kMouseFrame = 1000; // microseconds
+static constexpr uint8_t kMouseFracBits = 8;
+static constexpr int32_t kMouseMinSpeed = 64;   // 0.25 counts per frame
+static constexpr int32_t kMouseMaxSpeed = 1024; // 4 counts per frame
+static constexpr int32_t kWheelMinSpeed = 2;
+static constexpr int32_t kWheelMaxSpeed = 16;
+static constexpr uint32_t kMouseAccelFrames = 1000;
+// Bounds the work done for a pass that comes late
+static constexpr uint32_t kMouseMaxFramesPerPass = 32;
+
+struct MouseMotion {
+  uint8_t moving;      // MOUSE_MOVE_ bits being held
+  uint32_t frames;     // frames since the movement started
+  int32_t x, y, wheel; // carried fractions of a count
+  usec_t lastStep;
+};
+
+static MouseMotion mouseMotion;
+static MouseReport lastMouseReport;
+
+static void sendMouseToHost(MouseReport *report) {
+  Keyboard.sendMouseReport(report);
+}
+static void (*mouseSink)(MouseReport *report) = sendMouseToHost;
+
+// Returns the speed after frames of acceleration
+static int32_t mouseSpeed(int32_t minSpeed, int32_t maxSpeed,
+                          uint32_t frames) {
+  if (frames >= kMouseAccelFrames) {
+    return maxSpeed;
+  }
+  return minSpeed + (maxSpeed - minSpeed) * int32_t(frames * frames) /
+                        int32_t(kMouseAccelFrames * kMouseAccelFrames);
+}
+
+// Takes the whole counts out of a fixed point accumulator,
+// limited to what fits in a report
+static int8_t mouseTake(int32_t &acc) {
+  int32_t whole = acc / (1 << kMouseFracBits);
+  if (whole > 127) {
+    whole = 127;
+  } else if (whole < -127) {
+    whole = -127;
+  }
+  acc -= whole * (1 << kMouseFracBits);
+  return whole;
+}
+
+// Adds one frame of motion in the directions held in moving
+static void mouseAdd(MouseMotion &m, uint8_t moving, int32_t speed,
+                     int32_t wheelSpeed) {
+  if (moving & MOUSE_MOVE_RIGHT) {
+    m.x += speed;
+  }
+  if (moving & MOUSE_MOVE_LEFT) {
+    m.x -= speed;
+  }
+  if (moving & MOUSE_MOVE_DOWN) {
+    m.y += speed;
+  }
+  if (moving & MOUSE_MOVE_UP) {
+    m.y -= speed;
+  }
+  if (moving & MOUSE_MOVE_WHEEL_UP) {
+    m.wheel += wheelSpeed;
+  }
+  if (moving & MOUSE_MOVE_WHEEL_DOWN) {
+    m.wheel -= wheelSpeed;
+  }
+}
+
+// Advances the motion by frames while holding the directions in
+// moving, filling in the movement fields of report.  This does not
+// touch the hardware or the clock.
+void mouseStep(MouseMotion &m, uint8_t moving, uint32_t frames,
+               MouseReport &report) {
+  if (moving != m.moving) {
+    if (!m.moving) {
+      // Starting from rest: nudge by one count straight away so
+      // that a tap always moves the pointer
+      m.frames = 0;
+      m.x = m.y = m.wheel = 0;
+      mouseAdd(m, moving, 1 << kMouseFracBits, 1 << kMouseFracBits);
+    }
+    m.moving = moving;
+  }
+
+  for (; frames; --frames) {
+    mouseAdd(m, moving,
+             mouseSpeed(kMouseMinSpeed, kMouseMaxSpeed, m.frames),
+             mouseSpeed(kWheelMinSpeed, kWheelMaxSpeed, m.frames));
+    if (m.frames < kMouseAccelFrames) {
+      ++m.frames;
+    }
+  }
+
+  report.x = mouseTake(m.x);
+  report.y = mouseTake(m.y);
+  report.wheel = mouseTake(m.wheel);
+}
+
+// Called after processMatrix() on every pass
+void updateMouse(usec_t now) {
+  MouseReport report;
+  memset(&report, 0, sizeof(report));
+  uint8_t moving = 0;
+  for (slotmask_t live = keyStates.down; live; live &= live - 1) {
+    auto action = keyStates.action[__builtin_ctz(live)];
+    switch (action & kMask) {
+      case kMouseButton:
+        report.buttons |= action & 0xff;
+        break;
+      case kMouseMove:
+        moving |= action & 0xff;
+        break;
+    }
+  }
+
+  if (!moving && !mouseMotion.moving) {
+    if (report.buttons != lastMouseReport.buttons) {
+      lastMouseReport = report;
+      mouseSink(&report);
+    }
+    return;
+  }
+
+  uint32_t frames = 0;
+  if (!mouseMotion.moving) {
+    mouseMotion.lastStep = now;
+  } else {
+    frames = uint32_t(now - mouseMotion.lastStep) / kMouseFrame;
+    mouseMotion.lastStep += frames * kMouseFrame;
+    if (frames > kMouseMaxFramesPerPass) {
+      frames = kMouseMaxFramesPerPass;
+    }
+  }
+  mouseStep(mouseMotion, moving, frames, report);
+
+  if (report.x || report.y || report.wheel ||
+      report.buttons != lastMouseReport.buttons) {
+    lastMouseReport = report;
+    mouseSink(&report);
+  }
+}
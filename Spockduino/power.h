@@ -0,0 +1,247 @@
+#pragma once
+// This file holds the adaptive scan rate logic.
+// While any key is held, or something changed recently, we scan
+// flat out.  Once the board goes quiet we progressively back off
+// the scan interval and sleep the CPU between scans.  With SLEEP
+// set, after a longer period of inactivity we stop scanning
+// altogether: the rows are all driven low and we sleep until a
+// column pin or the expander NINT line pulls low and wakes us via
+// the EIC.  If the host has suspended the USB bus we can go further
+// and enter standby.
+//
+// The price of backing off is latency on the first key press after
+// going idle, so we measure that, up to the report going out, and
+// reduce the backoff limit if it exceeds kMaxFirstPressLatency.
+
+// Set by Spockduino.ino to stop scanning when idle.  This needs the
+// NINT line of every expander wired to kExpanderIntPin on the
+// Feather, which is a fifth wire between the halves; without it we
+// could not see right hand presses while asleep, so we never stop
+// scanning and just idle at the backoff limit.
+#ifndef SLEEP
+#define SLEEP 0
+#endif
+
+// How long to keep scanning at full rate after the last change
+static constexpr uint32_t kActiveHoldoff = 1000; // milliseconds
+// The idle scan interval doubles up to this limit
+static constexpr uint32_t kMaxIdleInterval = 16; // milliseconds
+// Upper bound on the idle-to-report time for the first key press
+static constexpr uint32_t kMaxFirstPressLatency = 10000; // microseconds
+
+static uint32_t lastActivity = 0;
+static uint32_t nextScan = 0;
+static uint32_t idleInterval = 1;
+static uint32_t idleIntervalLimit = kMaxIdleInterval;
+static uint32_t scanStart = 0;
+// micros() at the start of the last scan that saw no change,
+// or when we woke from sleep
+static uint32_t quietSince = 0;
+static bool wasIdle = false;
+// true from the pass that saw the first key press after going idle
+// until its report goes out
+static bool firstPressPending = false;
+
+// Time from the last quiet scan (or wake up) to sending the report
+// for the first key press after going idle.  This is an upper bound
+// on the latency added by backing off.
+uint32_t firstPressLatency = 0;
+uint32_t firstPressLatencyMax = 0;
+
+static bool keysHeld() {
+  return lastRead.any();
+}
+
+#if SLEEP
+// How long to remain idle before we stop scanning entirely
+static constexpr uint32_t kSleepAfter = 30000; // milliseconds
+// The Feather pin that the expander NINT lines are wired to; TX is
+// spare, as the sketch doesn't use Serial1
+static constexpr int kExpanderIntPin = 1;
+
+static bool busSuspended = false;
+static uint16_t lastFrameNumber = 0;
+static volatile bool wakeRequested = false;
+
+// Drive every row low so that pressing any key pulls its column
+// low; this lets the column pins (and the expander NINT line)
+// wake us up from sleep without scanning.  Interrupt delivery
+// is set up by the caller; this just arranges the levels.
+static void armKeyScannerWake() {
+  for (const auto &pin : rowPins) {
+    digitalWrite(pin, LOW);
+  }
+  for (uint8_t i = 0; i < kNumExpanders; ++i) {
+    auto &expander = expanders[i].device;
+    if (!expanders[i].up) {
+      continue;
+    }
+    expander.dataA(0);
+
+    // Sense falling edges on the expander columns (0b10 per pin)
+    // and route them to NINT.  NINT is open drain, so the lines
+    // from several expanders can be tied together.
+    expander.senseB(0b1010101010101010);
+    expander.clearInterruptsB();
+    expander.interruptMaskB(~expanderConfigs[i].colMask);
+  }
+}
+
+// Undo armKeyScannerWake() and return the rows to their idle
+// high state, ready for scanMatrix().
+static void disarmKeyScannerWake() {
+  for (auto &e : expanders) {
+    if (e.up) {
+      e.device.interruptMaskB(0xff);
+      e.device.clearInterruptsB();
+      e.device.dataA(0b00111111);
+    }
+  }
+  for (const auto &pin : rowPins) {
+    digitalWrite(pin, HIGH);
+  }
+}
+
+static void detachWakeInterrupts() {
+  for (const auto &pin : colPins) {
+    detachInterrupt(digitalPinToInterrupt(pin));
+  }
+  detachInterrupt(digitalPinToInterrupt(kExpanderIntPin));
+}
+
+static void wakeFromInterrupt() {
+  wakeRequested = true;
+  // These are level triggered, so stop them from firing
+  // again for as long as the key is held down
+  detachWakeInterrupts();
+}
+
+// The USB frame number stops advancing when the host suspends
+// the bus or we are unplugged; only then is it safe to stop the
+// clocks that the USB peripheral depends upon.
+static void sampleBusState() {
+  uint16_t frameNumber = USB->DEVICE.FNUM.bit.FNUM;
+  busSuspended = frameNumber == lastFrameNumber;
+  lastFrameNumber = frameNumber;
+}
+
+static void sleepUntilKeyPress() {
+  wakeRequested = false;
+  armKeyScannerWake();
+
+  // LOW rather than FALLING because edge detection needs the
+  // EIC clock, which is not running in standby
+  for (const auto &pin : colPins) {
+    attachInterrupt(digitalPinToInterrupt(pin), wakeFromInterrupt, LOW);
+  }
+  attachInterrupt(digitalPinToInterrupt(kExpanderIntPin), wakeFromInterrupt,
+                  LOW);
+
+  bool standby = busSuspended;
+  if (standby) {
+    SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+  }
+  while (!wakeRequested) {
+    // Check and sleep with interrupts masked so that a wake up
+    // between the two can't be lost; a pending interrupt still
+    // causes __WFI() to return.  Outside of standby SysTick
+    // wakes us every millisecond and we just go back to sleep,
+    // keeping the timebase up to date as we go.
+    nowMicros();
+    __disable_irq();
+    if (!wakeRequested) {
+      __DSB();
+      __WFI();
+    }
+    __enable_irq();
+  }
+  SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+  if (standby) {
+    // Signal remote wakeup so that the host resumes the bus
+    USB->DEVICE.CTRLB.bit.UPRSM = 1;
+  }
+
+  detachWakeInterrupts();
+  disarmKeyScannerWake();
+
+  quietSince = micros();
+  wasIdle = true;
+  lastActivity = millis();
+  idleInterval = 1;
+  nextScan = lastActivity;
+}
+#else
+static void sampleBusState() {}
+#endif
+
+// Called from loop() before each scan; sleeps until the
+// next scan is due.
+void waitForNextScan() {
+#if SLEEP
+  if (wasIdle && millis() - lastActivity >= kSleepAfter) {
+    sleepUntilKeyPress();
+  }
+#endif
+
+  while ((int32_t)(nextScan - millis()) > 0) {
+    // SysTick will wake us on the next millisecond tick
+    __WFI();
+  }
+  // Only line up with the USB frames while scanning flat out;
+  // when backed off latency is already traded for power
+  sofWaitForSlot(!wasIdle);
+  scanStart = micros();
+}
+
+// Called after each scan with the return value from
+// processMatrix(); schedules the next scan.
+void noteScanActivity(bool keysChanged) {
+  auto now = millis();
+
+  if (keysChanged && wasIdle) {
+    firstPressPending = true;
+  }
+
+  if (keysChanged || keysHeld() || debouncing) {
+    lastActivity = now;
+    idleInterval = 1;
+    nextScan = now;
+    wasIdle = false;
+    return;
+  }
+
+  quietSince = scanStart;
+  if (now - lastActivity < kActiveHoldoff) {
+    nextScan = now;
+    return;
+  }
+
+  wasIdle = true;
+  sampleBusState();
+  nextScan = now + idleInterval;
+  if (idleInterval < idleIntervalLimit) {
+    idleInterval *= 2;
+  }
+}
+
+// Called from dispatchTask() for each keyboard report, with sent
+// false if it is held until the host configures us.  The first one
+// after going idle ends the first press latency; a held one has no
+// latency worth measuring.
+void noteKeyboardReport(bool sent) {
+  if (!firstPressPending) {
+    return;
+  }
+  firstPressPending = false;
+  if (!sent) {
+    return;
+  }
+  firstPressLatency = micros() - quietSince;
+  if (firstPressLatency > firstPressLatencyMax) {
+    firstPressLatencyMax = firstPressLatency;
+  }
+  if (firstPressLatency > kMaxFirstPressLatency && idleIntervalLimit > 1) {
+    // Backing off is costing too much; be less aggressive
+    idleIntervalLimit /= 2;
+  }
+}
@@ -0,0 +1,710 @@
+#pragma once
+// This file holds the replay driver for the keymap engine.
+// It feeds key events through processMatrix() under a virtual clock,
+// capturing the reports instead of sending them to the host, and
+// measures how many events per second the engine gets through.
+// A trace replay feeds the events of a captured trace (see trace.h);
+// the report hashes recorded alongside them are the golden output,
+// so this tells us whether the engine still produces what it did
+// when the session was captured.  Each press recorded with a macro
+// action must queue that macro again, and nothing else may queue
+// one.  The synthetic replay runs a fast overlapping roll and a
+// tap-hold heavy workload.  The property check runs random key
+// sequences and timings through the engine and checks its
+// invariants, comparing each report with a slow reference model of
+// the keymap semantics.
+// linux/spock-replay runs all of these on the host, against trace
+// dumps on disk; on the device, MACRO(2), MACRO(3) and MACRO(4) run
+// them against the trace ring once bound to a key, and print the
+// results to the serial port.  The engine state is saved and
+// restored around a replay, so keys held at the time are unaffected.
+
+#ifndef REPLAY
+#define REPLAY 0
+#endif
+
+// Synthetic typing speed; 200 WPM is about 60ms between keys
+static constexpr uint32_t kReplayRollInterval = 60000; // microseconds
+static constexpr uint32_t kReplayRollHold = 90000; // microseconds
+static constexpr uint16_t kReplayRollKeys = 2000;
+static constexpr uint16_t kReplayTapHoldCycles = 500;
+static constexpr uint32_t kReplayRandomPasses = 20000;
+// Passes with more layer keys than the layer stack holds
+static constexpr uint32_t kReplayLayerPasses = 5000;
+static constexpr uint8_t kReplayLayerKeys = sizeof(layer_stack) + 2;
+// Release everything this often and check that nothing is stuck
+static constexpr uint8_t kReplayReleaseAllEvery = 64;
+
+#if REPLAY
+enum ReplayKind : uint8_t {
+  kReplayNone,
+  kReplayTrace,
+  kReplaySynthetic,
+  kReplayProperties,
+};
+
+struct ReplayResult {
+  uint32_t passes;
+  uint32_t events;
+  uint32_t reports;
+  uint32_t compared;
+  uint32_t mismatches;
+  uint32_t elapsed; // microseconds spent in processMatrix()
+  // Invariant violations found by the property checks
+  uint32_t stuck;
+  uint32_t layerBounds;
+  uint32_t reportSize;
+  uint32_t firstFailure; // pass number, or 0
+  // The roughness of the synthetic mouse motion
+  uint8_t mouseJerk;
+  uint32_t mouseStall;
+};
+
+static ReplayKind replayRequested = kReplayNone;
+static ReplayResult replayResult;
+static matrix_t replayMatrix;
+static usec_t replayTime;
+static bool replayPending;
+static int16_t replayExpect;
+static uint8_t replayExpectMacros;
+static uint8_t replayLastHash;
+static KeyReport replayLastReport;
+
+static void discardConsumer(ConsumerReport *) {}
+
+static void captureReport(KeyReport *report) {
+  replayLastReport = *report;
+  replayLastHash = reportHash(*report);
+  ++replayResult.reports;
+}
+
+// Runs the engine over the events accumulated for the current
+// timestamp, checking the report against the expected hash if
+// we have one.
+static void replayFlush() {
+  if (!replayPending) {
+    return;
+  }
+  replayPending = false;
+
+  auto reports = replayResult.reports;
+  // Macros queued during a replay are checked and dropped, never run
+  numPendingMacros = 0;
+  auto start = micros();
+  processMatrix(replayMatrix, replayTime);
+  // The golden hash is of the report from this pass, not of the
+  // release of a tap that follows it
+  bool reported = replayResult.reports != reports;
+  auto hash = replayLastHash;
+  bool macrosMatch = numPendingMacros == replayExpectMacros;
+  numPendingMacros = 0;
+  if (last_was_tap) {
+    // The engine needs another pass to release a tap
+    processMatrix(replayMatrix, replayTime + 1);
+  }
+  replayResult.elapsed += micros() - start;
+  ++replayResult.passes;
+
+  if (replayExpect >= 0) {
+    ++replayResult.compared;
+  }
+  if ((replayExpect >= 0 && (!reported || hash != replayExpect)) ||
+      !macrosMatch) {
+    ++replayResult.mismatches;
+    if (!replayResult.firstFailure) {
+      replayResult.firstFailure = replayResult.passes;
+    }
+  }
+}
+
+// Queues a key event.  Events with the same timestamp are
+// applied in the same pass.  expect is the hash of the report
+// that the pass should produce, or -1 if it isn't known; macro is
+// true if the event should queue a macro.
+static void replayFeed(usec_t time, uint8_t scanCode, bool down,
+                       int16_t expect, bool macro = false) {
+  if (replayPending && time != replayTime) {
+    replayFlush();
+  }
+  if (!replayPending) {
+    replayExpectMacros = 0;
+  }
+  replayTime = time;
+  replayPending = true;
+  replayExpect = expect;
+  if (macro && replayExpectMacros < sizeof(pendingMacros)) {
+    ++replayExpectMacros;
+  }
+  ++replayResult.events;
+
+  replayMatrix.set(scanCode, down);
+}
+
+// Finds the scan codes on the base layer with the given opcode,
+// and optionally HID usages in [minUsage, maxUsage]
+static uint8_t findScanCodes(uint32_t opcode, uint8_t *codes, uint8_t max,
+                             uint8_t minUsage = 0, uint8_t maxUsage = 0xff) {
+  uint8_t n = 0;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys && n < max;
+       ++scanCode) {
+    auto action = activeKeymap[0][scanCode];
+    auto usage = action & 0xff;
+    if ((action & kMask) == opcode && usage >= minUsage &&
+        usage <= maxUsage) {
+      codes[n++] = scanCode;
+    }
+  }
+  return n;
+}
+
+// Each key is pressed before the previous one is released
+static void replayRoll() {
+  uint8_t letters[26];
+  auto n = findScanCodes(kKeyPress, letters, sizeof(letters),
+                         HID_KEYBOARD_A, HID_KEYBOARD_Z);
+  if (!n) {
+    return;
+  }
+  usec_t t = 0;
+  for (uint16_t i = 0; i < kReplayRollKeys; ++i) {
+    t += kReplayRollInterval;
+    replayFeed(t, letters[i % n], true, -1);
+    if (i > 0) {
+      replayFeed(t + kReplayRollHold - kReplayRollInterval,
+                 letters[(i - 1) % n], false, -1);
+    }
+  }
+  replayFeed(t + kReplayRollHold, letters[(kReplayRollKeys - 1) % n], false,
+             -1);
+}
+
+// Alternates taps of a tap-hold key with holds that overlap
+// another key, some of which cross kTapInterval
+static void replayTapHold() {
+  uint8_t tapHold, letter;
+  if (!findScanCodes(kTapHold, &tapHold, 1) ||
+      !findScanCodes(kKeyPress, &letter, 1, HID_KEYBOARD_A, HID_KEYBOARD_Z)) {
+    return;
+  }
+  usec_t t = 0;
+  for (uint16_t i = 0; i < kReplayTapHoldCycles; ++i) {
+    auto hold = kTapInterval - 20000 + (i % 40) * 1000;
+    replayFeed(t, tapHold, true, -1);
+    replayFeed(t + 80000, tapHold, false, -1);
+    replayFeed(t + 200000, tapHold, true, -1);
+    replayFeed(t + 230000, letter, true, -1);
+    replayFeed(t + 260000, letter, false, -1);
+    replayFeed(t + 200000 + hold, tapHold, false, -1);
+    t += 600000;
+  }
+}
+
+// Holds a mouse movement key for kReplayMouseFrames, stepping the
+// mouse keys one USB frame at a time, and reports how smooth the
+// motion was and what it cost.  The speed changes by much less than
+// a count from one frame to the next, so the counts sent should
+// differ by at most one; at the minimum speed a count is due every
+// few frames, which bounds the frames that send none.
+static constexpr uint32_t kReplayMouseFrames = 2000;
+static constexpr uint8_t kReplayMouseMaxJerk = 1;
+static constexpr uint32_t kReplayMouseMaxStall =
+    (1 << kMouseFracBits) / kMouseMinSpeed - 1;
+
+static void replayMouse() {
+  MouseMotion m;
+  memset(&m, 0, sizeof(m));
+  MouseReport report;
+  int32_t distance = 0;
+  int8_t last = 0;
+  uint8_t maxJerk = 0;
+  uint32_t stall = 0, maxStall = 0;
+
+  auto start = micros();
+  for (uint32_t frame = 0; frame < kReplayMouseFrames; ++frame) {
+    mouseStep(m, MOUSE_MOVE_RIGHT, frame ? 1 : 0, report);
+    distance += report.x;
+    int16_t delta = report.x - last;
+    uint8_t jerk = delta < 0 ? -delta : delta;
+    if (frame && jerk > maxJerk) {
+      maxJerk = jerk;
+    }
+    last = report.x;
+    stall = report.x ? 0 : stall + 1;
+    if (stall > maxStall) {
+      maxStall = stall;
+    }
+  }
+  auto elapsed = micros() - start;
+  mouseStep(m, 0, 0, report);
+  replayResult.mouseJerk = maxJerk;
+  replayResult.mouseStall = maxStall;
+
+  Serial.print("replay mouse: frames=");
+  Serial.print(kReplayMouseFrames);
+  Serial.print(" distance=");
+  Serial.print(distance);
+  Serial.print(" maxJerk=");
+  Serial.print(maxJerk);
+  Serial.print(" maxStall=");
+  Serial.print(maxStall);
+  Serial.print(" nsPerFrame=");
+  Serial.print((uint32_t)((uint64_t)elapsed * 1000 / kReplayMouseFrames));
+  Serial.print("\r\n");
+}
+
+#if TRACE
+static void replayTrace() {
+  uint16_t first = (traceBuffer.head - traceBuffer.count) & (kTraceSize - 1);
+  // The records hold the low 32 bits of the time; extend them
+  usec_t time = 0;
+  uint32_t lastTime = traceBuffer.records[first].time;
+  for (uint16_t n = 0; n < traceBuffer.count; ++n) {
+    const auto &rec = traceBuffer.records[(first + n) & (kTraceSize - 1)];
+    time += rec.time - lastTime;
+    lastTime = rec.time;
+    if (rec.scanCode == kTraceReset) {
+      replayFlush();
+      resetKeyState();
+      memset(&replayMatrix, 0, sizeof(replayMatrix));
+      continue;
+    }
+    // Only passes that sent a keyboard report can be compared
+    bool down = rec.flags & kTraceDown;
+    replayFeed(time, rec.scanCode, down,
+               rec.flags & kTraceReported ? rec.reportHash : -1,
+               down && (rec.action & kMask) == kMacro);
+  }
+}
+#else
+static void replayTrace() {}
+#endif
+
+// The reference model for the property checks.  It tracks every
+// key individually rather than through keyStates slots, and
+// recomputes the whole report on every pass.
+struct ReplayModel {
+  bool down[matrix_t::kKeys];
+  bool dropped[matrix_t::kKeys];
+  action_t action[matrix_t::kKeys];
+  usec_t pressed[matrix_t::kKeys];
+  bool pushed[matrix_t::kKeys]; // layer keys that pushed their layer
+  uint8_t layers[sizeof(layer_stack)];
+  uint8_t pos;
+  uint8_t held;
+};
+static ReplayModel replayModel;
+static uint32_t replaySeed;
+
+static uint32_t replayRandom() {
+  // xorshift32
+  replaySeed ^= replaySeed << 13;
+  replaySeed ^= replaySeed >> 17;
+  replaySeed ^= replaySeed << 5;
+  return replaySeed;
+}
+
+static bool replayIsDown(const matrix_t &m, uint8_t scanCode) {
+  return m.isDown(scanCode);
+}
+
+// Advances the model from before to after at time now, and computes
+// the report that the engine should produce and how many keys
+// compete for it; only the first six fit.  Returns false if the
+// engine is legitimately allowed to differ, once it runs short of
+// slots.
+static bool modelPass(const matrix_t &before,
+                      const matrix_t &after, usec_t now,
+                      KeyReport &expect, uint8_t &wanted) {
+  auto &m = replayModel;
+  bool comparable = true;
+  bool tapped[matrix_t::kKeys] = {false};
+
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    bool isDown = replayIsDown(after, scanCode);
+    if (isDown == replayIsDown(before, scanCode)) {
+      continue;
+    }
+    if (isDown) {
+      if (m.held + 1 >= kNumSlots) {
+        // The engine may now drop keys or reap a slot before its
+        // tap has been reported
+        comparable = false;
+      }
+      if (m.held == kNumSlots) {
+        m.dropped[scanCode] = true;
+        continue;
+      }
+      int s = m.pos;
+      while (s >= 0 && (m.layers[s] >= activeLayers ||
+                        activeKeymap[m.layers[s]][scanCode] == ___)) {
+        --s;
+      }
+      m.action[scanCode] = s >= 0 ? activeKeymap[m.layers[s]][scanCode] : ___;
+      m.down[scanCode] = true;
+      m.pressed[scanCode] = now;
+      ++m.held;
+      if ((m.action[scanCode] & kMask) == kLayer &&
+          m.pos + 1 < sizeof(m.layers)) {
+        m.layers[++m.pos] = m.action[scanCode] & 0xff;
+        m.pushed[scanCode] = true;
+      }
+    } else {
+      if (m.dropped[scanCode]) {
+        m.dropped[scanCode] = false;
+        continue;
+      }
+      m.down[scanCode] = false;
+      --m.held;
+      switch (m.action[scanCode] & kMask) {
+        case kLayer:
+          // A press that found the stack full pushed nothing
+          if (m.pushed[scanCode] && m.pos > 0) {
+            --m.pos;
+          }
+          m.pushed[scanCode] = false;
+          break;
+        case kTapHold:
+          // The engine measures in ticks, which are aligned to 0
+          tapped[scanCode] = (now >> kKeyTickShift) -
+                                 (m.pressed[scanCode] >> kKeyTickShift) <=
+                             kTapTicks;
+          break;
+      }
+    }
+  }
+
+  memset(&expect, 0, sizeof(expect));
+  wanted = 0;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    auto action = m.action[scanCode];
+    uint8_t key = 0;
+    if (m.down[scanCode]) {
+      switch (action & kMask) {
+        case kKeyAndMod:
+          key = action & 0xff;
+          // fall through
+        case kTapHold:
+          expect.modifiers |= (action >> 16) & 0xff;
+          break;
+        case kKeyPress:
+          key = action & 0xff;
+          break;
+        case kModifier:
+          expect.modifiers |= action & 0xff;
+          break;
+        case kToggleMod:
+          expect.modifiers ^= action & 0xff;
+          break;
+      }
+    } else if (tapped[scanCode]) {
+      key = action & 0xff;
+    }
+    if (key) {
+      if (wanted < 6) {
+        expect.keys[wanted] = key;
+      }
+      ++wanted;
+    }
+  }
+  return comparable;
+}
+
+static bool sameReport(const KeyReport &a, const KeyReport &b) {
+  if (a.modifiers != b.modifiers) {
+    return false;
+  }
+  // The engine orders keys by slot; compare them as sets
+  for (auto key : a.keys) {
+    uint8_t inA = 0, inB = 0;
+    for (auto k : a.keys) {
+      inA += k == key;
+    }
+    for (auto k : b.keys) {
+      inB += k == key;
+    }
+    if (inA != inB) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void replayViolation(uint32_t &counter, uint32_t pass) {
+  ++counter;
+  if (!replayResult.firstFailure) {
+    replayResult.firstFailure = pass;
+  }
+}
+
+// Runs one engine pass over replayMatrix and checks it
+static void replayCheckedPass(uint32_t pass, usec_t now) {
+  KeyReport expect;
+  uint8_t wanted;
+  auto before = lastRead;
+  bool comparable = modelPass(before, replayMatrix, now, expect, wanted);
+
+  auto reports = replayResult.reports;
+  auto overflows = reportOverflows;
+  auto start = micros();
+  processMatrix(replayMatrix, now);
+  replayResult.elapsed += micros() - start;
+  ++replayResult.passes;
+
+  if (layer_pos >= sizeof(layer_stack) ||
+      (comparable && layer_pos != replayModel.pos)) {
+    replayViolation(replayResult.layerBounds, pass);
+  }
+  if (replayResult.reports != reports && comparable) {
+    // A full report must hold six keys and leave out exactly the
+    // rest, rather than drop any silently
+    uint8_t repsize = 0;
+    for (auto key : replayLastReport.keys) {
+      repsize += key != 0;
+    }
+    uint8_t fits = wanted < 6 ? wanted : 6;
+    if (repsize != fits || reportOverflows - overflows != wanted - fits) {
+      replayViolation(replayResult.reportSize, pass);
+    }
+    if (wanted <= 6) {
+      ++replayResult.compared;
+      if (!sameReport(replayLastReport, expect)) {
+        replayViolation(replayResult.mismatches, pass);
+      }
+    }
+  }
+}
+
+// Releases every key and checks that nothing stays stuck
+static void replayReleaseAll(uint32_t pass, usec_t &now) {
+  memset(&replayMatrix, 0, sizeof(replayMatrix));
+  replayCheckedPass(pass, now);
+  // One more pass to flush out any tap release
+  replayCheckedPass(pass, ++now);
+  bool anyDown = keyStates.down || layer_pos != 0 ||
+                 replayLastReport.modifiers;
+  for (auto key : replayLastReport.keys) {
+    anyDown |= key != 0;
+  }
+  if (anyDown) {
+    replayViolation(replayResult.stuck, pass);
+  }
+}
+
+// Presses and releases random keys from candidates at random
+// intervals, weighted towards the kTapInterval boundary,
+// periodically releasing all keys
+static void replayRandomPasses(const uint8_t *candidates,
+                               uint8_t numCandidates, uint32_t &pass,
+                               uint32_t passes, usec_t &now) {
+  static const uint32_t intervals[] = {
+      1, 100, 1000, 20000, 400000,
+      kTapInterval - 16, kTapInterval - 1, kTapInterval,
+      kTapInterval + 1, kTapInterval + 16};
+
+  for (auto end = pass + passes; pass < end; ++pass) {
+    now += intervals[replayRandom() %
+                     (sizeof(intervals) / sizeof(intervals[0]))];
+
+    if (pass % kReplayReleaseAllEvery == 0) {
+      replayReleaseAll(pass, now);
+      continue;
+    }
+
+    auto changes = 1 + replayRandom() % 3;
+    while (changes--) {
+      auto scanCode = candidates[replayRandom() % numCandidates];
+      if (replayModel.held > replayRandom() % 24) {
+        // Favour releases as more keys are held, so that we mostly
+        // stay within the report but still sometimes run out of slots
+        for (uint8_t n = 0;
+             n < matrix_t::kKeys && !replayIsDown(replayMatrix, scanCode);
+             ++n) {
+          scanCode = (scanCode + 1) % matrix_t::kKeys;
+        }
+      }
+      replayMatrix.toggle(scanCode);
+      ++replayResult.events;
+    }
+    replayCheckedPass(pass, now);
+  }
+}
+
+// The keymap for the layer stack passes: the active keymap, with
+// kReplayLayerKeys plain keys on the base layer pushing layer 1, so
+// that some presses find the stack full
+static action_t replayLayerKeymap[kNumLayers][matrix_t::kKeys];
+
+static bool replayIsMacro(uint8_t scanCode) {
+  for (uint8_t layer = 0; layer < activeLayers; ++layer) {
+    if ((activeKeymap[layer][scanCode] & kMask) == kMacro) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs the random passes over every key but the macros, which would
+// start dumps and replays, then over the layer keys of
+// replayLayerKeymap and a few keys of layer 1
+static void replayProperties() {
+  memset(&replayModel, 0, sizeof(replayModel));
+  replaySeed = 0x5eed1234;
+
+  uint8_t candidates[matrix_t::kKeys];
+  uint8_t numCandidates = 0;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    if (!replayIsMacro(scanCode)) {
+      candidates[numCandidates++] = scanCode;
+    }
+  }
+  usec_t now = 1;
+  uint32_t pass = 1;
+  replayRandomPasses(candidates, numCandidates, pass, kReplayRandomPasses,
+                     now);
+  replayReleaseAll(pass, now);
+
+  uint8_t layers = activeLayers < kNumLayers ? activeLayers : kNumLayers;
+  if (layers < 2) {
+    return;
+  }
+  memcpy(replayLayerKeymap, activeKeymap, layers * sizeof(keymap[0]));
+  uint8_t numLayerKeys = 0, numLayerOne = 0;
+  numCandidates = 0;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    auto &action = replayLayerKeymap[0][scanCode];
+    if (replayIsMacro(scanCode)) {
+      continue;
+    }
+    if (numLayerKeys < kReplayLayerKeys && (action & kMask) == kKeyPress &&
+        replayLayerKeymap[1][scanCode] == ___) {
+      action = kLayer | 1;
+      candidates[numCandidates++] = scanCode;
+      ++numLayerKeys;
+    } else if (numLayerOne < 6 && replayLayerKeymap[1][scanCode] != ___) {
+      candidates[numCandidates++] = scanCode;
+      ++numLayerOne;
+    }
+  }
+  auto savedKeymap = activeKeymap;
+  auto savedLayers = activeLayers;
+  activeKeymap = replayLayerKeymap;
+  activeLayers = layers;
+  replayRandomPasses(candidates, numCandidates, pass, kReplayLayerPasses,
+                     now);
+  replayReleaseAll(pass, now);
+  activeKeymap = savedKeymap;
+  activeLayers = savedLayers;
+}
+
+void requestTraceReplay() {
+  replayRequested = kReplayTrace;
+}
+
+void requestSyntheticReplay() {
+  replayRequested = kReplaySynthetic;
+}
+
+void requestPropertyCheck() {
+  replayRequested = kReplayProperties;
+}
+
+// Called from loop(); runs a replay if one was requested
+void runReplayIfRequested() {
+  auto kind = replayRequested;
+  if (kind == kReplayNone) {
+    return;
+  }
+  replayRequested = kReplayNone;
+
+  // Save the live engine state
+  auto savedStates = keyStates;
+  auto savedEpoch = keyEpoch;
+  uint8_t savedStack[sizeof(layer_stack)];
+  memcpy(savedStack, layer_stack, sizeof(layer_stack));
+  auto savedPos = layer_pos;
+  auto savedRead = lastRead;
+  auto savedTap = last_was_tap;
+  auto savedSink = reportSink;
+  auto savedConsumerSink = consumerSink;
+  auto savedConsumer = lastConsumer;
+  auto savedNumMacros = numPendingMacros;
+  uint8_t savedMacros[sizeof(pendingMacros)];
+  memcpy(savedMacros, pendingMacros, sizeof(pendingMacros));
+
+  pauseTrace(true);
+  pauseUsage(true);
+  reportSink = captureReport;
+  consumerSink = discardConsumer;
+  resetKeyState();
+  memset(&replayMatrix, 0, sizeof(replayMatrix));
+  memset(&replayResult, 0, sizeof(replayResult));
+  replayPending = false;
+
+  if (kind == kReplayTrace) {
+    replayTrace();
+  } else if (kind == kReplaySynthetic) {
+    replayRoll();
+    replayTapHold();
+  } else {
+    replayProperties();
+  }
+  replayFlush();
+
+  reportSink = savedSink;
+  consumerSink = savedConsumerSink;
+  lastConsumer = savedConsumer;
+  numPendingMacros = savedNumMacros;
+  memcpy(pendingMacros, savedMacros, sizeof(pendingMacros));
+  pauseTrace(false);
+  pauseUsage(false);
+  keyStates = savedStates;
+  keyEpoch = savedEpoch;
+  memcpy(layer_stack, savedStack, sizeof(layer_stack));
+  layer_pos = savedPos;
+  lastRead = savedRead;
+  last_was_tap = savedTap;
+
+  Serial.print(kind == kReplayTrace       ? "replay trace"
+               : kind == kReplaySynthetic ? "replay synthetic"
+                                          : "replay properties");
+  Serial.print(": events=");
+  Serial.print(replayResult.events);
+  Serial.print(" passes=");
+  Serial.print(replayResult.passes);
+  Serial.print(" reports=");
+  Serial.print(replayResult.reports);
+  Serial.print(" compared=");
+  Serial.print(replayResult.compared);
+  Serial.print(" mismatches=");
+  Serial.print(replayResult.mismatches);
+  Serial.print(" keyStateBytes=");
+  Serial.print(sizeof(keyStates));
+  Serial.print(" events/sec=");
+  Serial.print(replayResult.elapsed
+                   ? (uint32_t)((uint64_t)replayResult.events * 1000000 /
+                                replayResult.elapsed)
+                   : 0);
+  if (kind == kReplayProperties) {
+    Serial.print(" stuck=");
+    Serial.print(replayResult.stuck);
+    Serial.print(" layerBounds=");
+    Serial.print(replayResult.layerBounds);
+    Serial.print(" reportSize=");
+    Serial.print(replayResult.reportSize);
+  }
+  if (kind != kReplaySynthetic) {
+    Serial.print(" firstFailure=");
+    Serial.print(replayResult.firstFailure);
+  }
+  Serial.print("\r\n");
+
+  if (kind == kReplaySynthetic) {
+    replayMouse();
+  }
+}
+#else
+void requestTraceReplay() {}
+void requestSyntheticReplay() {}
+void requestPropertyCheck() {}
+void runReplayIfRequested() {}
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+// This file holds a small cooperative scheduler.
+// The work of each pass is split into stages (scanning, running
+// the keymap engine, sending the report, playing macros and
+// diagnostics) that run as separate tasks.  A task is released by
+// loop() or by an earlier stage and then runs to completion; when
+// several are ready the one with the lowest id runs first, so the
+// task table doubles as the priority order.
+// Each task has a deadline measured from its release.  We record
+// how long every run took and how many finished late; the
+// instrumentation pages carry these to the host.
+// The scheduler only depends upon nowMicros(), so it runs just
+// as well against the mock clock in timebase.h.
+
+struct Task {
+  void (*run)(usec_t now);
+  uint32_t deadline; // microseconds after release
+};
+
+struct TaskStats {
+  uint32_t runs;
+  uint32_t missed;     // runs that finished after their deadline
+  uint32_t maxRunTime; // microseconds
+};
+
+class Scheduler {
+  public:
+    static constexpr uint8_t kMaxTasks = 5;
+
+    // tasks is indexed by task id, highest priority first
+    void init(const Task *tasks, uint8_t numTasks) {
+      tasks_ = tasks;
+      numTasks_ = numTasks < kMaxTasks ? numTasks : kMaxTasks;
+      pending_ = 0;
+      memset(stats, 0, sizeof(stats));
+    }
+
+    // Makes a task ready to run.  Releasing a task that is
+    // already pending keeps its original release time.
+    void release(uint8_t id, usec_t now) {
+      uint8_t bit = 1 << id;
+      if (id < numTasks_ && !(pending_ & bit)) {
+        pending_ |= bit;
+        releasedAt_[id] = now;
+      }
+    }
+
+    bool pending(uint8_t id) const {
+      return pending_ & (1 << id);
+    }
+
+    // Runs ready tasks in priority order until none remain.
+    // Tasks may release others (or themselves) as they run.
+    void run() {
+      while (pending_) {
+        uint8_t id = __builtin_ctz(pending_);
+        pending_ &= ~(1 << id);
+
+        auto start = nowMicros();
+        tasks_[id].run(start);
+        auto end = nowMicros();
+
+        auto &s = stats[id];
+        ++s.runs;
+        uint32_t runTime = end - start;
+        if (runTime > s.maxRunTime) {
+          s.maxRunTime = runTime;
+        }
+        if (end - releasedAt_[id] > tasks_[id].deadline) {
+          ++s.missed;
+        }
+      }
+    }
+
+    TaskStats stats[kMaxTasks];
+
+  private:
+    const Task *tasks_ = nullptr;
+    uint8_t numTasks_ = 0;
+    uint8_t pending_ = 0;
+    usec_t releasedAt_[kMaxTasks];
+};
+
+static Scheduler scheduler;
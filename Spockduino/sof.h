@@ -0,0 +1,193 @@
+#pragma once
+// This file holds the start-of-frame synchronization.
+// The host polls the keyboard endpoint once per 1ms USB frame, so a
+// report loaded just after a poll sits in the endpoint for almost a
+// whole frame before it goes out.  With SOF_SYNC set to 1 we hook
+// the USB interrupt to timestamp every start-of-frame, and while
+// scanning at full rate we delay the start of each scan so that it,
+// and the report that it produces, complete just before the next
+// SOF.  The report then goes out with the IN token of that frame
+// built from the freshest matrix that we could have read.
+// The time needed for a pass is learned as we go; with INSTRUMENT
+// set we also record the phase from the start of a scan to the SOF
+// that carried its report, which is the latency that we add.
+// SOF_SYNC needs a core that provides USB_SetHandler().
+//
+// This file also measures the report cadence that we actually get.
+// We ask for a 1ms polling interval (KEYBOARD_POLL_INTERVAL), but
+// the host decides; with INSTRUMENT set we timestamp the transfer
+// complete interrupt of every keyboard report and record both the
+// time from loading the report to the host taking it and, when the
+// next report was already waiting as one was taken, the time until
+// the host took that one too.  That too hooks the USB interrupt, so
+// it needs USB_SetHandler() as well.
+
+#ifndef SOF_SYNC
+#define SOF_SYNC 0
+#endif
+
+static constexpr uint32_t kFramePeriod = 1000; // microseconds
+// How long before the SOF the report must be in the endpoint
+static constexpr uint32_t kSofGuard = 50; // microseconds
+// Our initial guess at the time for a scan and report
+static constexpr uint32_t kInitialPassTime = 400; // microseconds
+
+#if SOF_SYNC || INSTRUMENT
+extern "C" void USB_SetHandler(void (*handler)(void));
+#endif
+
+#if SOF_SYNC
+static volatile uint32_t sofTime = 0;
+static uint32_t sofPassTime = kInitialPassTime;
+static uint32_t sofPassStart = 0;
+static bool sofReportLoaded = false;
+// Set when a report is loaded; the next SOF then measures the
+// phase from the start of its scan
+static volatile bool sofPhaseArmed = false;
+static volatile bool sofPhaseReady = false;
+static volatile uint32_t sofPhase;
+static volatile uint32_t sofPhaseStart;
+
+static inline void sofInterrupt() {
+  if (USB->DEVICE.INTFLAG.reg & USB_DEVICE_INTFLAG_SOF) {
+    auto now = micros();
+    sofTime = now;
+    if (sofPhaseArmed) {
+      sofPhase = now - sofPhaseStart;
+      sofPhaseArmed = false;
+      sofPhaseReady = true;
+    }
+    USB->DEVICE.INTFLAG.reg = USB_DEVICE_INTFLAG_SOF;
+  }
+}
+
+// Called before each scan.  When align is true and frames are
+// arriving, waits until the pass will just finish before the
+// next SOF.
+void sofWaitForSlot(bool align) {
+  if (sofPhaseReady) {
+    INSTR_VALUE(kHistScanToSof, sofPhase);
+    sofPhaseReady = false;
+  }
+  sofReportLoaded = false;
+
+  uint32_t lastSof = sofTime;
+  auto now = micros();
+  if (align && now - lastSof < 2 * kFramePeriod) {
+    // Aim for the first slot that we haven't already missed; if we
+    // are too late for this frame then waiting for the next one
+    // still delivers at the same time, but with fresher data
+    uint32_t target = lastSof + kFramePeriod - kSofGuard - sofPassTime;
+    while ((int32_t)(target - now) < 0) {
+      target += kFramePeriod;
+    }
+    while ((int32_t)(target - micros()) > 0) {
+    }
+  }
+  sofPassStart = micros();
+}
+
+// Called by the dispatch stage when a report has been loaded
+inline void sofNoteReport() {
+  sofReportLoaded = true;
+  sofPhaseStart = sofPassStart;
+  sofPhaseArmed = true;
+}
+
+// Called once the pass is complete.  We move quickly to cover
+// a pass that took longer than expected and decay slowly so that
+// an occasional fast one doesn't make us late.
+void sofEndPass() {
+  if (!sofReportLoaded) {
+    return;
+  }
+  uint32_t elapsed = micros() - sofPassStart;
+  if (elapsed > sofPassTime) {
+    sofPassTime = elapsed;
+  } else {
+    sofPassTime -= (sofPassTime - elapsed) / 16;
+  }
+  if (sofPassTime > kFramePeriod - kSofGuard) {
+    sofPassTime = kFramePeriod - kSofGuard;
+  }
+}
+#else
+static inline void sofInterrupt() {}
+inline void sofWaitForSlot(bool) {}
+inline void sofNoteReport() {}
+inline void sofEndPass() {}
+#endif
+
+#if INSTRUMENT
+static uint32_t cadenceQueueTime;
+static uint32_t cadenceLoadTime;
+static uint32_t cadenceLastTaken;
+static bool cadenceHaveLast = false;
+static volatile uint32_t cadenceTakenTime;
+static volatile bool cadenceTaken = false;
+
+// USBDevice.send() waits on the transfer complete flag before it
+// loads the next report, so we must leave the flag alone; instead
+// we mask the interrupt again until the next keyboard report.
+static inline void cadenceInterrupt() {
+  auto &ep = USB->DEVICE.DeviceEndpoint[Keyboard.endpoint()];
+  if ((ep.EPINTENSET.reg & USB_DEVICE_EPINTENSET_TRCPT1) &&
+      (ep.EPINTFLAG.reg & USB_DEVICE_EPINTFLAG_TRCPT1)) {
+    cadenceTakenTime = micros();
+    cadenceTaken = true;
+    ep.EPINTENCLR.reg = USB_DEVICE_EPINTENCLR_TRCPT1;
+  }
+}
+
+// Called once the pass is complete, to record a report that the
+// host has taken since
+void cadenceEndPass() {
+  if (!cadenceTaken) {
+    return;
+  }
+  cadenceTaken = false;
+  uint32_t taken = cadenceTakenTime;
+  INSTR_VALUE(kHistReportDelivery, taken - cadenceLoadTime);
+  // Only a report that was ready before the last one was taken
+  // measures the polling interval; otherwise the gap is just time
+  // that we had nothing to send
+  if (cadenceHaveLast && int32_t(cadenceLastTaken - cadenceQueueTime) >= 0) {
+    INSTR_VALUE(kHistReportInterval, taken - cadenceLastTaken);
+  }
+  cadenceLastTaken = taken;
+  cadenceHaveLast = true;
+}
+
+// Called by the dispatch stage when a keyboard report has been
+// loaded into the endpoint; queued is when it was ready to send
+inline void cadenceNoteReport(uint32_t queued) {
+  // Catch up with the previous one first
+  cadenceEndPass();
+  cadenceQueueTime = queued;
+  cadenceLoadTime = micros();
+  USB->DEVICE.DeviceEndpoint[Keyboard.endpoint()].EPINTENSET.reg =
+      USB_DEVICE_EPINTENSET_TRCPT1;
+}
+#else
+static inline void cadenceInterrupt() {}
+inline void cadenceNoteReport(uint32_t) {}
+inline void cadenceEndPass() {}
+#endif
+
+#if SOF_SYNC || INSTRUMENT
+static void usbInterrupt() {
+  sofInterrupt();
+  cadenceInterrupt();
+  USBDevice.ISRHandler();
+}
+#endif
+
+// Called from setup(), after the USB device has been attached
+void initSofSync() {
+#if SOF_SYNC || INSTRUMENT
+  USB_SetHandler(usbInterrupt);
+#endif
+#if SOF_SYNC
+  USB->DEVICE.INTENSET.reg = USB_DEVICE_INTENSET_SOF;
+#endif
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <SPI.h>
+
+// minimal SPI NOR flash driver, for the 2MB GD25Q16 that the
+// Feather M0 Express carries on SPI1.  Erase and program only
+// start the operation; the chip then works on its own and busy()
+// tells us when it will take the next command, so the caller
+// never has to sit and wait for one to finish.
+class SPIFlash {
+  public:
+    static constexpr uint32_t kSize = 2 * 1024 * 1024;
+    static constexpr uint32_t kSectorSize = 4096;
+    static constexpr uint16_t kPageSize = 256;
+    static constexpr uint32_t kClock = 12000000;
+
+    static constexpr uint8_t kCmdWriteEnable = 0x06;
+    static constexpr uint8_t kCmdReadStatus = 0x05;
+    static constexpr uint8_t kCmdRead = 0x03;
+    static constexpr uint8_t kCmdPageProgram = 0x02;
+    static constexpr uint8_t kCmdSectorErase = 0x20;
+    static constexpr uint8_t kCmdJedecId = 0x9f;
+    static constexpr uint8_t kStatusBusy = 0x01;
+
+    SPIFlash(SPIClass &spi, uint8_t csPin) : spi_(spi), csPin_(csPin) {}
+
+    // Returns true if a flash chip answers
+    bool init() {
+      pinMode(csPin_, OUTPUT);
+      digitalWrite(csPin_, HIGH);
+      spi_.begin();
+      auto id = jedecId();
+      return id != 0 && id != 0xffffff;
+    }
+
+    uint32_t jedecId() {
+      select();
+      spi_.transfer(kCmdJedecId);
+      uint32_t id = uint32_t(spi_.transfer(0)) << 16;
+      id |= uint32_t(spi_.transfer(0)) << 8;
+      id |= spi_.transfer(0);
+      deselect();
+      return id;
+    }
+
+    // true while an erase or program is in progress
+    bool busy() {
+      select();
+      spi_.transfer(kCmdReadStatus);
+      uint8_t status = spi_.transfer(0);
+      deselect();
+      return status & kStatusBusy;
+    }
+
+    // Reads len bytes at addr.  Don't call this while busy().
+    void read(uint32_t addr, void *buf, uint16_t len) {
+      select();
+      command(kCmdRead, addr);
+      auto bytes = static_cast<uint8_t *>(buf);
+      while (len--) {
+        *bytes++ = spi_.transfer(0xff);
+      }
+      deselect();
+    }
+
+    // Starts programming len bytes at addr, which must all lie in
+    // one page.  Returns false if the chip was busy.
+    bool startProgram(uint32_t addr, const void *buf, uint16_t len) {
+      if (busy()) {
+        return false;
+      }
+      writeEnable();
+      select();
+      command(kCmdPageProgram, addr);
+      auto bytes = static_cast<const uint8_t *>(buf);
+      while (len--) {
+        spi_.transfer(*bytes++);
+      }
+      deselect();
+      return true;
+    }
+
+    // Starts erasing the sector holding addr.  Returns false if
+    // the chip was busy.
+    bool startEraseSector(uint32_t addr) {
+      if (busy()) {
+        return false;
+      }
+      writeEnable();
+      select();
+      command(kCmdSectorErase, addr);
+      deselect();
+      return true;
+    }
+
+  private:
+    void select() {
+      spi_.beginTransaction(SPISettings(kClock, MSBFIRST, SPI_MODE0));
+      digitalWrite(csPin_, LOW);
+    }
+
+    void deselect() {
+      digitalWrite(csPin_, HIGH);
+      spi_.endTransaction();
+    }
+
+    void command(uint8_t cmd, uint32_t addr) {
+      spi_.transfer(cmd);
+      spi_.transfer(addr >> 16);
+      spi_.transfer(addr >> 8);
+      spi_.transfer(addr);
+    }
+
+    void writeEnable() {
+      select();
+      spi_.transfer(kCmdWriteEnable);
+      deselect();
+    }
+
+    SPIClass &spi_;
+    uint8_t csPin_;
+};
@@ -1,29 +1,38 @@
 #pragma once
 #include <Wire.h>
 
-// minimal SX1509 IO Expander driver
+// minimal SX1509 IO Expander driver.  Several devices can share
+// the bus; the ADDR pins select one of 0x3e, 0x3f, 0x70 or 0x71.
 class SX1509 {
   public:
-    static constexpr uint8_t kDeviceAddress = 0x3e;
-    static constexpr uint16_t kTimeout = 1000;
+    static constexpr uint8_t kDefaultAddress = 0x3e;
+    // How long to wait for the bytes of a read to arrive
+    static constexpr uint32_t kReadTimeout = 500; // microseconds
+    // Half period of the clock used to recover a stuck bus
+    static constexpr uint8_t kRecoveryHalfPeriod = 5; // microseconds
 
     static constexpr uint8_t kRegReset = 0x7d;
     static constexpr uint8_t kRegDirectionA = 0xf;
     static constexpr uint8_t kRegDirectionB = 0xe;
+    static constexpr uint8_t kRegInterruptMaskB = 0x12;
     static constexpr uint8_t kRegInterruptMaskA = 0x13;
+    static constexpr uint8_t kRegSenseHighB = 0x14;
+    static constexpr uint8_t kRegSenseLowB = 0x15;
+    static constexpr uint8_t kRegInterruptSourceB = 0x18;
     static constexpr uint8_t kRegDataA = 0x11;
     static constexpr uint8_t kRegDataB = 0x10;
     static constexpr uint8_t kRegPullUpA = 0x7;
     static constexpr uint8_t kRegPullUpB = 0x6;
 
-    // Initialize I2C and initiate a reset of the expander
-    bool init() {
-      Wire.begin();
-      softwareReset();
+    explicit SX1509(uint8_t address = kDefaultAddress) : address_(address) {}
+
+    uint8_t address() const {
+      return address_;
+    }
 
-      // Test that the device is responding correctly by
-      // checking that we read the correct values for
-      // a register.
+    // Test that the device is responding correctly after a reset
+    // by checking that we read the reset values for a register.
+    bool checkReset() {
       uint16_t regs ;
       if (!read(kRegInterruptMaskA, regs)) {
         return false;
@@ -66,6 +75,54 @@ class SX1509 {
       return write(kRegPullUpB, mask);
     }
 
+    // Enable the NINT output for bank B; 0 bits are enabled
+    bool interruptMaskB(uint8_t mask) {
+      return write(kRegInterruptMaskB, mask);
+    }
+
+    // Configure edge sensing for bank B; 2 bits per pin, with
+    // pins 15-12 in the high byte and pins 11-8 in the low byte
+    bool senseB(uint16_t sense) {
+      return write(kRegSenseHighB, sense >> 8) &&
+             write(kRegSenseLowB, sense & 0xff);
+    }
+
+    // Clear any pending bank B interrupt sources, releasing NINT
+    bool clearInterruptsB() {
+      return write(kRegInterruptSourceB, 0xff);
+    }
+
+    // Free a bus that a slave is holding SDA low on, for example
+    // because it was reset or unplugged part way through a read.
+    // We take the pins back from the SERCOM, clock SCL until the
+    // slave lets go of SDA, then issue a STOP.  Both lines are only
+    // ever driven low; the pullups take them high.  Returns true if
+    // the bus is idle afterwards.
+    static bool recoverBus() {
+      Wire.end();
+      pinMode(PIN_WIRE_SDA, INPUT_PULLUP);
+      pinMode(PIN_WIRE_SCL, INPUT_PULLUP);
+
+      for (int i = 0; i < 9 && !digitalRead(PIN_WIRE_SDA); ++i) {
+        pinMode(PIN_WIRE_SCL, OUTPUT);
+        digitalWrite(PIN_WIRE_SCL, LOW);
+        delayMicroseconds(kRecoveryHalfPeriod);
+        pinMode(PIN_WIRE_SCL, INPUT_PULLUP);
+        delayMicroseconds(kRecoveryHalfPeriod);
+      }
+
+      // STOP: SDA rises while SCL is high
+      pinMode(PIN_WIRE_SDA, OUTPUT);
+      digitalWrite(PIN_WIRE_SDA, LOW);
+      delayMicroseconds(kRecoveryHalfPeriod);
+      pinMode(PIN_WIRE_SDA, INPUT_PULLUP);
+      delayMicroseconds(kRecoveryHalfPeriod);
+
+      bool idle = digitalRead(PIN_WIRE_SDA) && digitalRead(PIN_WIRE_SCL);
+      Wire.begin();
+      return idle;
+    }
+
     // Initiate a software reset
     void softwareReset() {
       write(kRegReset, 0x12);
@@ -74,31 +131,33 @@ class SX1509 {
 
     // Write a value to a register
     bool write(uint8_t addr, uint8_t val) {
-      Wire.beginTransmission(kDeviceAddress);
+      Wire.beginTransmission(address_);
       Wire.write(addr);
       Wire.write(val);
-      Wire.endTransmission();
+      return Wire.endTransmission() == 0;
     }
 
     // Read bytes starting from the specified register address
     bool read(uint8_t addr, uint8_t* bytes, uint8_t bufsize) {
-      unsigned int timeout = kTimeout * bufsize;
-
-      Wire.beginTransmission(kDeviceAddress);
+      Wire.beginTransmission(address_);
       Wire.write(addr);
-      Wire.endTransmission();
-      Wire.requestFrom(kDeviceAddress, bufsize);
-
-      while ((Wire.available() < bufsize) && (timeout != 0)) {
-        timeout--;
+      if (Wire.endTransmission(false) != 0) {
+        // NACK; the device isn't there
+        return false;
       }
-
-      if (timeout == 0) {
+      if (Wire.requestFrom(address_, bufsize) != bufsize) {
         return false;
       }
 
+      auto start = micros();
+      while (Wire.available() < bufsize) {
+        if (micros() - start >= kReadTimeout) {
+          return false;
+        }
+      }
+
       while (bufsize-- > 0) {
-        *bytes = Wire.read();
+        *bytes++ = Wire.read();
       }
       return true;
     }
@@ -117,4 +176,7 @@ class SX1509 {
       }
       return false;
     }
+
+  private:
+    uint8_t address_;
 };
@@ -0,0 +1,44 @@
+#pragma once
+// This file holds the timebase used for key timing.
+// micros() is derived from SysTick and wraps every 71 minutes, so we
+// extend it to a monotonic 64-bit count of microseconds since boot.
+// Short intervals can also be measured with wrap-safe uint32_t
+// differences of the low bits.
+// Set TIMEBASE_MOCK to 1 to drive the clock by hand, for example
+// when running the engine away from the hardware.
+
+#ifndef TIMEBASE_MOCK
+#define TIMEBASE_MOCK 0
+#endif
+
+typedef uint64_t usec_t;
+
+#if TIMEBASE_MOCK
+usec_t timebaseMockNow = 0;
+
+inline usec_t nowMicros() {
+  return timebaseMockNow;
+}
+#else
+static uint32_t timebaseLow = 0;
+static uint32_t timebaseHigh = 0;
+
+// Returns the time since boot in microseconds.  This must be
+// called at least every half hour to notice the wrap of micros();
+// the main loop and the sleep loop both do so.
+usec_t nowMicros() {
+  uint32_t t = micros();
+  if (t < timebaseLow) {
+    if (timebaseLow - t < 0x80000000u) {
+      // micros() can step back slightly when it races with the
+      // SysTick interrupt; hold the time steady rather than
+      // mistaking it for a wrap
+      t = timebaseLow;
+    } else {
+      ++timebaseHigh;
+    }
+  }
+  timebaseLow = t;
+  return (usec_t(timebaseHigh) << 32) | t;
+}
+#endif
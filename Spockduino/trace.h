@@ -0,0 +1,185 @@
+#pragma once
+// This file holds the key event trace.
+// Every key transition seen by processMatrix() is appended to a fixed
+// size ring buffer of compact binary records, so that when a key
+// sticks or a keystroke goes missing we can pull out what the
+// firmware actually saw.  The buffer lives in a section that the
+// startup code doesn't zero, so it survives a watchdog or software
+// reset; a magic number tells us whether it holds anything valid.
+// MACRO(1) dumps the trace over the serial port (if it is open) and
+// the vendor diagnostics report; tools/spock-trace.py decodes it.
+
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+struct TraceRecord {
+  uint32_t time;      // low 32 bits of nowMicros()
+  uint32_t action;    // resolved action for the key
+  uint8_t scanCode;   // kTraceReset for the boot marker
+  uint8_t flags;      // kTraceDown | kTraceReported | slot number
+  uint8_t layers;     // bitmap of the layers on the stack
+  uint8_t reportHash; // hash of the report emitted for this pass
+};
+
+struct TraceHeader {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t recordSize;
+};
+
+static constexpr uint32_t kTraceMagic = 0x544b5053; // "SPKT"
+static constexpr uint16_t kTraceSize = 256; // must be a power of 2
+static constexpr uint8_t kTraceDown = 0x80;
+// Set once the pass that saw the event sent a keyboard report, so
+// that an empty report (whose hash is 0) can be told from none
+static constexpr uint8_t kTraceReported = 0x40;
+static constexpr uint8_t kTraceNoSlot = 0x3f;
+static constexpr uint8_t kTraceReset = 0xff;
+static constexpr uint8_t kTraceRecordsPerPage =
+    sizeof(VendorReport::data) / sizeof(TraceRecord);
+
+// A cheap hash of a report, used to check replays against a trace.
+// The host reads the keys of a report as a set, and the order that
+// the engine lists them in depends on which slots it reaped, so they
+// are hashed in sorted order.
+uint8_t reportHash(const KeyReport &report) {
+  KeyReport sorted = report;
+  auto &keys = sorted.keys;
+  for (uint8_t i = 1; i < sizeof(keys); ++i) {
+    for (uint8_t j = i; j > 0 && keys[j - 1] > keys[j]; --j) {
+      auto key = keys[j];
+      keys[j] = keys[j - 1];
+      keys[j - 1] = key;
+    }
+  }
+  uint8_t hash = 0;
+  for (auto b : reinterpret_cast<const uint8_t (&)[sizeof(sorted)]>(sorted)) {
+    hash = ((hash << 1) | (hash >> 7)) ^ b;
+  }
+  return hash;
+}
+
+#if TRACE
+struct TraceBuffer {
+  uint32_t magic;
+  uint16_t head;
+  uint16_t count;
+  TraceRecord records[kTraceSize];
+};
+__attribute__((section(".noinit"))) static TraceBuffer traceBuffer;
+static uint16_t tracePassStart;
+static bool traceDumpRequested = false;
+static bool tracePaused = false;
+
+static void traceRecord(uint8_t scanCode, uint8_t flags, uint32_t action,
+                        uint8_t layers, uint32_t now) {
+  if (tracePaused) {
+    return;
+  }
+  auto &rec = traceBuffer.records[traceBuffer.head];
+  traceBuffer.head = (traceBuffer.head + 1) & (kTraceSize - 1);
+  if (traceBuffer.count < kTraceSize) {
+    ++traceBuffer.count;
+  }
+  rec.time = now;
+  rec.action = action;
+  rec.scanCode = scanCode;
+  rec.flags = flags;
+  rec.layers = layers;
+  rec.reportHash = 0;
+}
+
+// Called from setup().  Keeps a valid trace from before the reset
+// and appends a marker recording the reset cause.
+void initTrace() {
+  if (traceBuffer.magic != kTraceMagic || traceBuffer.head >= kTraceSize ||
+      traceBuffer.count > kTraceSize) {
+    traceBuffer.magic = kTraceMagic;
+    traceBuffer.head = 0;
+    traceBuffer.count = 0;
+  }
+  traceRecord(kTraceReset, kTraceNoSlot, PM->RCAUSE.reg, 0, nowMicros());
+}
+
+// Called at the start of processMatrix()
+inline void traceBeginPass() {
+  tracePassStart = traceBuffer.head;
+}
+
+inline void traceKeyEvent(uint8_t scanCode, bool down, uint8_t slot,
+                          uint32_t action, uint8_t layers, uint32_t now) {
+  traceRecord(scanCode, (down ? kTraceDown : 0) | slot, action, layers, now);
+}
+
+// Stamps the records from this pass with a hash of the report
+// that they produced
+void traceReportSent(const KeyReport &report) {
+  auto hash = reportHash(report);
+  for (auto i = tracePassStart; i != traceBuffer.head;
+       i = (i + 1) & (kTraceSize - 1)) {
+    traceBuffer.records[i].flags |= kTraceReported;
+    traceBuffer.records[i].reportHash = hash;
+  }
+}
+
+inline void requestTraceDump() {
+  traceDumpRequested = true;
+}
+
+// Stops recording while the replay driver runs
+inline void pauseTrace(bool paused) {
+  tracePaused = paused;
+}
+
+// Called from loop(); sends the trace, oldest record first, if
+// a dump was requested.
+void dumpTraceIfRequested() {
+  if (!traceDumpRequested) {
+    return;
+  }
+  traceDumpRequested = false;
+
+  TraceHeader header = {kTraceMagic, traceBuffer.count, sizeof(TraceRecord)};
+  uint16_t first = (traceBuffer.head - traceBuffer.count) & (kTraceSize - 1);
+
+  if (Serial) {
+    Serial.write(reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+    for (uint16_t n = 0; n < header.count; ++n) {
+      Serial.write(reinterpret_cast<const uint8_t *>(
+                       &traceBuffer.records[(first + n) & (kTraceSize - 1)]),
+                   sizeof(TraceRecord));
+    }
+  }
+
+  VendorReport report;
+  memset(&report, 0, sizeof(report));
+  report.kind = kVendorTraceHeader;
+  memcpy(report.data, &header, sizeof(header));
+  Keyboard.sendVendorReport(&report);
+
+  report.kind = kVendorTrace;
+  report.index = 0;
+  for (uint16_t n = 0; n < header.count;) {
+    memset(report.data, 0, sizeof(report.data));
+    // report.data isn't word aligned, so copy rather than assign
+    for (uint8_t i = 0; i < kTraceRecordsPerPage && n < header.count;
+         ++i, ++n) {
+      memcpy(report.data + i * sizeof(TraceRecord),
+             &traceBuffer.records[(first + n) & (kTraceSize - 1)],
+             sizeof(TraceRecord));
+    }
+    Keyboard.sendVendorReport(&report);
+    ++report.index;
+  }
+}
+#else
+void initTrace() {}
+inline void traceBeginPass() {}
+inline void traceKeyEvent(uint8_t, bool, uint8_t, uint32_t, uint8_t,
+                          uint32_t) {}
+inline void traceReportSent(const KeyReport &) {}
+inline void requestTraceDump() {}
+inline void pauseTrace(bool) {}
+void dumpTraceIfRequested() {}
+#endif
@@ -0,0 +1,365 @@
+#pragma once
+// This file holds the persistent key usage counters.
+// Set USAGE to 1 in Spockduino.ino to count the presses of every
+// scan code, so that we can see which keys earn their place when
+// working on the layout.  processMatrix() only bumps a counter in
+// RAM; the counts go out to the SPI flash from idle passes, at
+// most every kUsageFlushInterval, so a power cut loses at most
+// that much.
+// The flash holds a log of records in a ring of kUsageSectors
+// sectors.  A base sector starts with the totals for every key
+// that has any, and the sectors that follow it in the ring hold
+// the deltas flushed since.  Once the log spans kUsageCompactAfter
+// sectors we write a fresh base into the next sector, which
+// retires the old ones; sectors are erased strictly in ring order
+// so the wear is spread evenly.  A sector header is written only
+// once the sector is ready, so that a half written base is never
+// mistaken for a good one, and each record carries a check byte.
+// Every step is a single read, erase or page program that the
+// chip then completes on its own, so a flush never holds up a
+// report.
+// MACRO(5) sends the totals over the vendor diagnostics report;
+// tools/spock-usage.py decodes them.
+
+#ifndef USAGE
+#define USAGE 0
+#endif
+
+struct UsageRecord {
+  uint32_t count;
+  uint8_t scanCode;
+  uint8_t kind;
+  uint8_t check;
+  uint8_t reserved;
+};
+
+struct UsageHeader {
+  uint32_t magic;
+  uint32_t seq; // the sector is seq % kUsageSectors
+};
+
+static constexpr uint32_t kUsageBaseMagic = 0x42555053; // "SPUB"
+static constexpr uint32_t kUsageLogMagic = 0x4c555053;  // "SPUL"
+static constexpr uint8_t kUsageTotal = 1;
+static constexpr uint8_t kUsageDelta = 2;
+static constexpr uint8_t kUsageSectors = 16;
+static constexpr uint8_t kUsageCompactAfter = kUsageSectors / 2;
+static constexpr uint32_t kUsageFlushInterval = 60000; // milliseconds
+static constexpr uint8_t kUsagePerPage =
+    sizeof(VendorReport::data) / sizeof(uint32_t);
+static_assert(sizeof(UsageRecord) == 8 && sizeof(UsageHeader) == 8,
+              "usage records must keep their flash layout");
+
+#if USAGE
+#include "spiflash.h"
+
+static constexpr uint32_t kUsageBase =
+    SPIFlash::kSize - kUsageSectors * SPIFlash::kSectorSize;
+static constexpr uint16_t kUsageRecordsPerPage =
+    SPIFlash::kPageSize / sizeof(UsageRecord);
+static_assert(matrix_t::kKeys * sizeof(UsageRecord) + sizeof(UsageHeader) <=
+                  SPIFlash::kSectorSize / 2,
+              "a base must leave room for deltas in its sector");
+
+enum UsageState : uint8_t {
+  kUsageFindBase,  // looking for the newest base sector
+  kUsageLoad,      // reading the log a page at a time
+  kUsageIdle,      // appending deltas to the log
+  kUsageErase,     // erasing the next sector of the ring
+  kUsageWriteBase, // writing the totals into a fresh base
+  kUsageOffline,   // no flash chip
+};
+
+// Presses not yet flushed, and the totals that are in the flash
+uint16_t usagePresses[matrix_t::kKeys];
+uint32_t usageTotals[matrix_t::kKeys];
+
+static SPIFlash usageFlash(SPI1, SS1);
+static UsageState usageState = kUsageFindBase;
+static uint8_t usageScanSector; // next sector header to look at
+static bool usageBaseFound;     // usageBaseSeq holds a base
+static uint32_t usageBaseSeq;   // seq of the current base
+static uint32_t usageSeq;       // seq of the sector being appended to
+static uint16_t usageOffset;    // next free byte in that sector
+static bool usageCompacting;    // the erase is for a new base
+static uint16_t usageNextTotal; // scan code to write next into a base
+static uint32_t usageLastFlush = 0;
+static bool usageDumpRequested = false;
+static bool usagePaused = false;
+
+static uint32_t usageSectorAddr(uint32_t seq) {
+  return kUsageBase + (seq % kUsageSectors) * SPIFlash::kSectorSize;
+}
+
+static uint8_t usageCheck(const UsageRecord &rec) {
+  return 0xa5 ^ rec.scanCode ^ rec.kind ^ rec.count ^ (rec.count >> 8) ^
+         (rec.count >> 16) ^ (rec.count >> 24);
+}
+
+// A power cut can leave a record partly programmed, so the log
+// only ends where a record is still wholly erased
+static bool usageErased(const UsageRecord &rec) {
+  auto bytes = reinterpret_cast<const uint8_t *>(&rec);
+  for (uint8_t i = 0; i < sizeof(rec); ++i) {
+    if (bytes[i] != 0xff) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static UsageRecord usageRecord(uint8_t kind, uint8_t scanCode,
+                               uint32_t count) {
+  UsageRecord rec = {count, scanCode, kind, 0, 0xff};
+  rec.check = usageCheck(rec);
+  return rec;
+}
+
+// Counting a press is all that processMatrix() pays for
+inline void usageCountPress(uint8_t scanCode) {
+  if (!usagePaused && usagePresses[scanCode] < 0xffff) {
+    ++usagePresses[scanCode];
+  }
+}
+
+// Called from setup()
+void initUsage() {
+  if (!usageFlash.init()) {
+    usageState = kUsageOffline;
+  }
+}
+
+// Reads the header of one sector per call, looking for the newest
+// base; once it has seen them all, it picks that base or starts a
+// fresh log if there is none
+static void usageFindBase() {
+  if (usageScanSector < kUsageSectors) {
+    UsageHeader header;
+    usageFlash.read(kUsageBase + usageScanSector * SPIFlash::kSectorSize,
+                    &header, sizeof(header));
+    if (header.magic == kUsageBaseMagic &&
+        header.seq % kUsageSectors == usageScanSector &&
+        (!usageBaseFound || int32_t(header.seq - usageBaseSeq) > 0)) {
+      usageBaseSeq = header.seq;
+      usageBaseFound = true;
+    }
+    ++usageScanSector;
+    return;
+  }
+  if (usageBaseFound) {
+    usageSeq = usageBaseSeq;
+    usageOffset = sizeof(UsageHeader);
+    usageState = kUsageLoad;
+  } else {
+    // Nothing there yet; write an empty base into the first sector
+    usageBaseSeq = usageSeq = kUsageSectors - 1;
+    usageCompacting = true;
+    usageState = kUsageErase;
+  }
+}
+
+// Reads the next page of the log, or at the end of a sector the
+// header of the next.  The log ends at the first unwritten record,
+// or at a sector that doesn't follow on.
+static void usageLoadPage() {
+  if (usageOffset >= SPIFlash::kSectorSize) {
+    UsageHeader header;
+    usageFlash.read(usageSectorAddr(usageSeq + 1), &header, sizeof(header));
+    if (header.magic == kUsageLogMagic && header.seq == usageSeq + 1) {
+      ++usageSeq;
+      usageOffset = sizeof(UsageHeader);
+    } else {
+      // The last sector is full; the next flush moves on
+      usageState = kUsageIdle;
+    }
+    return;
+  }
+
+  UsageRecord records[kUsageRecordsPerPage];
+  uint16_t pageStart = usageOffset & ~(SPIFlash::kPageSize - 1);
+  usageFlash.read(usageSectorAddr(usageSeq) + pageStart, records,
+                  sizeof(records));
+  for (uint16_t i = (usageOffset - pageStart) / sizeof(UsageRecord);
+       i < kUsageRecordsPerPage; ++i, usageOffset += sizeof(UsageRecord)) {
+    const auto &rec = records[i];
+    if (usageErased(rec)) {
+      usageState = kUsageIdle;
+      return;
+    }
+    if (rec.scanCode >= matrix_t::kKeys || rec.check != usageCheck(rec)) {
+      // Torn by a power cut; skip it
+      continue;
+    }
+    if (rec.kind == kUsageTotal) {
+      usageTotals[rec.scanCode] = rec.count;
+    } else {
+      usageTotals[rec.scanCode] += rec.count;
+    }
+  }
+}
+
+static bool usageHasDeltas() {
+  for (auto presses : usagePresses) {
+    if (presses) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Starts a page program of deltas at the end of the log
+static void usageWriteDeltas() {
+  UsageRecord records[kUsageRecordsPerPage];
+  uint16_t room = (SPIFlash::kPageSize - usageOffset % SPIFlash::kPageSize) /
+                  sizeof(UsageRecord);
+  uint8_t n = 0;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys && n < room;
+       ++scanCode) {
+    if (usagePresses[scanCode]) {
+      records[n++] =
+          usageRecord(kUsageDelta, scanCode, usagePresses[scanCode]);
+    }
+  }
+  if (n && usageFlash.startProgram(usageSectorAddr(usageSeq) + usageOffset,
+                                   records, n * sizeof(UsageRecord))) {
+    usageOffset += n * sizeof(UsageRecord);
+    for (uint8_t i = 0; i < n; ++i) {
+      usageTotals[records[i].scanCode] += records[i].count;
+      usagePresses[records[i].scanCode] = 0;
+    }
+  }
+}
+
+// Starts a page program of the next totals for a new base, then
+// of its header once they are all down
+static void usageWriteBase() {
+  UsageRecord records[kUsageRecordsPerPage];
+  uint8_t n = 0;
+  uint16_t room = (SPIFlash::kPageSize - usageOffset % SPIFlash::kPageSize) /
+                  sizeof(UsageRecord);
+  uint16_t scanCode = usageNextTotal;
+  for (; scanCode < matrix_t::kKeys && n < room; ++scanCode) {
+    if (usageTotals[scanCode]) {
+      records[n++] = usageRecord(kUsageTotal, scanCode, usageTotals[scanCode]);
+    }
+  }
+  auto addr = usageSectorAddr(usageSeq);
+  if (n) {
+    if (usageFlash.startProgram(addr + usageOffset, records,
+                                n * sizeof(UsageRecord))) {
+      usageOffset += n * sizeof(UsageRecord);
+      usageNextTotal = scanCode;
+    }
+    return;
+  }
+  if (scanCode < matrix_t::kKeys) {
+    // A page with no totals left in it
+    usageNextTotal = scanCode;
+    return;
+  }
+  UsageHeader header = {kUsageBaseMagic, usageSeq};
+  if (usageFlash.startProgram(addr, &header, sizeof(header))) {
+    usageBaseSeq = usageSeq;
+    usageState = kUsageIdle;
+  }
+}
+
+// Moves the log on to the next sector of the ring
+static void usageNextSector() {
+  usageCompacting = usageSeq + 1 - usageBaseSeq >= kUsageCompactAfter;
+  usageState = kUsageErase;
+}
+
+// Called from an idle pass.  Does at most one flash operation and
+// returns without waiting for it to complete.
+void flushUsage() {
+  if (usageState == kUsageOffline || usageFlash.busy()) {
+    return;
+  }
+  switch (usageState) {
+    case kUsageFindBase:
+      usageFindBase();
+      break;
+    case kUsageLoad:
+      usageLoadPage();
+      break;
+    case kUsageErase:
+      if (usageFlash.startEraseSector(usageSectorAddr(usageSeq + 1))) {
+        ++usageSeq;
+        if (usageCompacting) {
+          usageOffset = sizeof(UsageHeader);
+          usageNextTotal = 0;
+          usageState = kUsageWriteBase;
+        } else {
+          // An offset of 0 means that the header is still to go in
+          usageOffset = 0;
+          usageState = kUsageIdle;
+        }
+      }
+      break;
+    case kUsageWriteBase:
+      usageWriteBase();
+      break;
+    case kUsageIdle:
+      if (usageOffset == 0) {
+        UsageHeader header = {kUsageLogMagic, usageSeq};
+        if (usageFlash.startProgram(usageSectorAddr(usageSeq), &header,
+                                    sizeof(header))) {
+          usageOffset = sizeof(UsageHeader);
+        }
+      } else if (millis() - usageLastFlush >= kUsageFlushInterval &&
+                 usageHasDeltas()) {
+        if (usageOffset >= SPIFlash::kSectorSize) {
+          usageNextSector();
+        } else {
+          usageWriteDeltas();
+          if (!usageHasDeltas()) {
+            usageLastFlush = millis();
+          }
+        }
+      }
+      break;
+    case kUsageOffline:
+      break;
+  }
+}
+
+inline void requestUsageDump() {
+  usageDumpRequested = true;
+}
+
+// Stops counting while the replay driver runs
+inline void pauseUsage(bool paused) {
+  usagePaused = paused;
+}
+
+// Called from an idle pass; sends the flushed totals plus the
+// presses not yet flushed
+void dumpUsageIfRequested() {
+  if (!usageDumpRequested) {
+    return;
+  }
+  usageDumpRequested = false;
+
+  VendorReport report;
+  report.kind = kVendorUsage;
+  report.index = 0;
+  for (uint16_t scanCode = 0; scanCode < matrix_t::kKeys;) {
+    memset(report.data, 0, sizeof(report.data));
+    for (uint8_t i = 0; i < kUsagePerPage && scanCode < matrix_t::kKeys;
+         ++i, ++scanCode) {
+      uint32_t count = usageTotals[scanCode] + usagePresses[scanCode];
+      memcpy(report.data + i * sizeof(count), &count, sizeof(count));
+    }
+    Keyboard.sendVendorReport(&report);
+    ++report.index;
+  }
+}
+#else
+inline void usageCountPress(uint8_t) {}
+void initUsage() {}
+void flushUsage() {}
+inline void requestUsageDump() {}
+inline void pauseUsage(bool) {}
+void dumpUsageIfRequested() {}
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+// Just enough of the Arduino core for the keymap engine to build
+// as a Linux program.  The clock is CLOCK_MONOTONIC and Serial
+// writes to stderr.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define HEX 16
+#define DEC 10
+
+inline uint64_t monotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+inline uint32_t micros() {
+  return monotonicMicros();
+}
+
+inline uint32_t millis() {
+  return monotonicMicros() / 1000;
+}
+
+struct SerialPort {
+  size_t print(const char *s) {
+    return fputs(s, stderr) < 0 ? 0 : strlen(s);
+  }
+  template <typename T>
+  size_t print(T value, int base = DEC) {
+    return fprintf(stderr, base == HEX ? "%llx" : "%lld",
+                   (long long)value);
+  }
+  template <typename T>
+  size_t println(T value) {
+    return print(value) + print("\n");
+  }
+  size_t write(const uint8_t *buf, size_t len) {
+    return fwrite(buf, 1, len, stderr);
+  }
+  explicit operator bool() const {
+    return true;
+  }
+};
+static SerialPort Serial __attribute__((unused));
+
+// The reset cause that trace.h records at boot; 0x01 is power on
+struct PmRegisters {
+  struct {
+    uint8_t reg;
+  } RCAUSE;
+};
+static PmRegisters pmRegisters __attribute__((unused)) = {{0x01}};
+#define PM (&pmRegisters)
@@ -0,0 +1,104 @@
+#pragma once
+// The Arduino HID library as seen by spock-gadget.  The real
+// Keyboard.cpp plugs into this, and its reports go out through the
+// kernel's HID gadget function (/dev/hidgN) instead of the SAMD
+// USB controller.  The kernel describes the interface and its
+// endpoint itself, so getInterface() is never called; output
+// reports from the host are handed to setup() as a SET_REPORT,
+// just as the core does.  The definitions are in spock-gadget.cpp.
+#include "Arduino.h"
+
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+
+#define USB_DEVICE_CLASS_HUMAN_INTERFACE 0x03
+#define HID_SUBCLASS_NONE 0
+#define HID_PROTOCOL_NONE 0
+#define HID_SET_REPORT 0x09
+#define REQUEST_HOSTTODEVICE_CLASS_INTERFACE 0x21
+#define USB_ENDPOINT_TYPE_INTERRUPT 0x03
+#define USB_ENDPOINT_IN(addr) uint8_t((addr) | 0x80)
+#define EPX_SIZE 64
+
+struct USBSetup {
+  uint8_t bmRequestType;
+  uint8_t bRequest;
+  uint8_t wValueL;
+  uint8_t wValueH;
+  uint16_t wIndex;
+  uint16_t wLength;
+};
+
+struct InterfaceDescriptor {
+  uint8_t len, dtype, number, alternate, numEndpoints, interfaceClass,
+      interfaceSubClass, protocol, iInterface;
+};
+
+struct HIDDescDescriptor {
+  uint8_t len, dtype, addr, versionH, country, desctype, descLenL, descLenH;
+};
+
+struct EndpointDescriptor {
+  uint8_t len, dtype, addr, attr;
+  uint16_t packetSize;
+  uint8_t interval;
+};
+
+struct HIDDescriptor {
+  InterfaceDescriptor hid;
+  HIDDescDescriptor desc;
+  EndpointDescriptor in;
+};
+
+#define D_INTERFACE(n, numEndpoints, cls, subClass, protocol) \
+  { 9, 4, n, 0, numEndpoints, cls, subClass, protocol, 0 }
+#define D_HIDREPORT(length) \
+  { 9, 0x21, 0x11, 0x01, 0, 0x22, uint8_t(length), uint8_t((length) >> 8) }
+#define D_ENDPOINT(addr, attr, packetSize, interval) \
+  { 7, 5, addr, attr, packetSize, interval }
+
+class PluggableUSBModule {
+  public:
+    virtual ~PluggableUSBModule() {}
+
+  protected:
+    virtual int getInterface(uint8_t *interfaceCount) = 0;
+    virtual bool setup(USBSetup &setup) = 0;
+    uint8_t pluggedInterface = 0;
+    uint8_t pluggedEndpoint = 1;
+    friend class USBDeviceClass;
+};
+
+class HIDSubDescriptor {
+  public:
+    HIDSubDescriptor(const void *d, const uint16_t l) : data(d), length(l) {}
+    HIDSubDescriptor *next = nullptr;
+    const void *data;
+    const uint16_t length;
+};
+
+class HID_ : public PluggableUSBModule {
+  public:
+    HID_(void);
+    int SendReport(uint8_t id, const void *data, int len);
+    void AppendDescriptor(HIDSubDescriptor *node);
+    // Copies out the report descriptor, for the gadget function
+    uint16_t reportDescriptor(uint8_t *buf, uint16_t size);
+
+  protected:
+    int getInterface(uint8_t *interfaceCount);
+    bool setup(USBSetup &setup);
+
+  private:
+    HIDSubDescriptor *rootNode = nullptr;
+};
+
+class USBDeviceClass {
+  public:
+    int sendControl(const void *data, uint32_t len);
+    uint32_t recvControl(void *data, uint32_t len);
+    // Passes an output report from the host to the plugged module
+    bool setReport(const uint8_t *report, uint16_t len);
+};
+extern USBDeviceClass USBDevice;
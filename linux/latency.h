@@ -0,0 +1,35 @@
+#pragma once
+// Latency statistics, in the log2 buckets of instrument.h
+struct LatencyStats {
+  uint32_t buckets[kNumBuckets];
+  uint32_t count;
+  uint64_t total;
+  uint32_t max;
+};
+
+static void recordLatency(LatencyStats &s, uint32_t elapsed) {
+  uint8_t bucket = elapsed ? 31 - __builtin_clz(elapsed) : 0;
+  if (bucket >= kNumBuckets) {
+    bucket = kNumBuckets - 1;
+  }
+  ++s.buckets[bucket];
+  ++s.count;
+  s.total += elapsed;
+  if (elapsed > s.max) {
+    s.max = elapsed;
+  }
+}
+
+static void printLatency(const LatencyStats &s) {
+  if (!s.count) {
+    return;
+  }
+  fprintf(stderr, "latency: events=%u mean=%lluus max=%uus\n", s.count,
+          (unsigned long long)(s.total / s.count), s.max);
+  for (uint8_t b = 0; b < kNumBuckets; ++b) {
+    if (s.buckets[b]) {
+      fprintf(stderr, "  %s%uus %u\n", b == kNumBuckets - 1 ? ">=" : "<",
+              b == kNumBuckets - 1 ? 1u << b : 1u << (b + 1), s.buckets[b]);
+    }
+  }
+}
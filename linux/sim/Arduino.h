@@ -0,0 +1,45 @@
+#pragma once
+// The Arduino core as seen by spock-scansim.  Time is simulated:
+// every pin operation, I2C transfer and call to micros() costs
+// what it would on the Feather, and the pins read the levels of
+// the simulated matrix.  The definitions are in spock-scansim.cpp.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define HEX 16
+#define DEC 10
+#define PIN_WIRE_SDA 20
+#define PIN_WIRE_SCL 21
+
+uint32_t micros();
+uint32_t millis();
+void delayMicroseconds(uint32_t us);
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int level);
+int digitalRead(int pin);
+
+struct SerialPort {
+  size_t print(const char *s) {
+    return fputs(s, stderr) < 0 ? 0 : strlen(s);
+  }
+  template <typename T>
+  size_t print(T value, int base = DEC) {
+    return fprintf(stderr, base == HEX ? "%llx" : "%lld",
+                   (long long)value);
+  }
+  template <typename T>
+  size_t println(T value) {
+    return print(value) + print("\n");
+  }
+  size_t write(const uint8_t *buf, size_t len) {
+    return fwrite(buf, 1, len, stderr);
+  }
+};
+static SerialPort Serial __attribute__((unused));
@@ -0,0 +1,3 @@
+#pragma once
+// Keyboard.h only needs the core types from the Arduino HID library
+#include "Arduino.h"
@@ -0,0 +1,17 @@
+#pragma once
+// The I2C bus as seen by spock-scansim, with a simulated SX1509
+#include "Arduino.h"
+
+class TwoWire {
+  public:
+    void begin();
+    void end();
+    void setClock(uint32_t hz);
+    void beginTransmission(uint8_t address);
+    size_t write(uint8_t byte);
+    uint8_t endTransmission(bool stop = true);
+    uint8_t requestFrom(uint8_t address, uint8_t count);
+    int available();
+    int read();
+};
+extern TwoWire Wire;
@@ -0,0 +1,646 @@
+// spock-evdev runs the Spock keymap engine on Linux.
+// It grabs a stock keyboard through evdev, maps its keys onto the
+// scan codes of the Spock matrix, runs the same processMatrix()
+// that the firmware does and sends the resulting reports out
+// through a uinput device.  That makes it possible to try out a
+// layout, or to look at the engine's latency, on a desktop.
+//
+// A key is mapped to the first layer 0 position that produces the
+// same key (or modifier, or media key), so most of a stock
+// keyboard lands where you'd expect.  Caps Lock takes the first
+// tap-hold position and the Menu key the first layer key; -m
+// CODE=SCANCODE adds or replaces a mapping, where CODE is a Linux
+// key code.  Keys that don't map anywhere pass straight through.
+//
+// Everything is driven by epoll: the engine runs once per evdev
+// SYN_REPORT, at the kernel's timestamp for the event, and a
+// timerfd ticks once per mouse frame while a mouse key is moving
+// the pointer.  The engine resolves tap-hold on release, so there
+// is nothing else to wait for.
+// The latency that we add is measured for every key event, from
+// the kernel's timestamp to the write of the resulting uinput
+// events; -v prints each one and a summary follows on exit.
+//
+// -k FILE loads a keymap in place of the built in one, through the
+// same chunk, commit and swap of hotswap.h that the firmware uses;
+// the file holds the reports that tools/spock-keymap.py -o writes.
+// SIGHUP loads the file again, keys held or not.  Without a DEVICE
+// we just load the keymap and report how it went.
+//
+// -t with -k checks a swap under held keys without any devices: we
+// hold a modifier, a letter, a layer key and a key on that layer,
+// load the keymap, release them all and check that the last report
+// is empty, exiting non-zero if it isn't.  make check runs this.
+//
+//   make && sudo ./spock-evdev /dev/input/by-id/...-event-kbd
+
+#define TIMEBASE_MOCK 1
+#define HOTSWAP 1
+
+#include "Arduino.h"
+#include "Keyboard.h"
+#include "keycodes.h"
+#include "timebase.h"
+#include "instrument.h"
+#include "log.h"
+#include "trace.h"
+#include "matrix.h"
+#include "keymap.h"
+#include "mouse.h"
+#include "usage.h"
+#include "hotswap.h"
+#include "hidcodes.h"
+#include "latency.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static constexpr uint8_t kNoScanCode = 0xff;
+
+static const uint16_t kMouseButtons[] = {BTN_LEFT, BTN_RIGHT, BTN_MIDDLE};
+
+static uint16_t codeForUsage[256];
+static uint8_t scanCodeForCode[KEY_CNT];
+
+static uint16_t codeForConsumer(uint16_t usage) {
+  for (auto &c : kConsumerUsages) {
+    if (c.usage == usage) {
+      return c.code;
+    }
+  }
+  return 0;
+}
+
+// Assigns code to scanCode, unless code already has a position
+static void mapCode(uint16_t code, uint8_t scanCode) {
+  if (code && scanCodeForCode[code] == kNoScanCode) {
+    scanCodeForCode[code] = scanCode;
+  }
+}
+
+static void buildKeyMap() {
+  for (auto &u : kKeyboardUsages) {
+    codeForUsage[u.usage] = u.code;
+  }
+  memset(scanCodeForCode, kNoScanCode, sizeof(scanCodeForCode));
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    auto action = keymap[0][scanCode];
+    switch (action & kMask) {
+      case kKeyPress:
+        mapCode(codeForUsage[action & 0xff], scanCode);
+        break;
+      case kModifier:
+        mapCode(codeForUsage[0xe0 + __builtin_ctz(action & 0xff)], scanCode);
+        break;
+      case kConsumer:
+        mapCode(codeForConsumer(action >> 16), scanCode);
+        break;
+      case kTapHold:
+        mapCode(KEY_CAPSLOCK, scanCode);
+        break;
+      case kLayer:
+        mapCode(KEY_COMPOSE, scanCode);
+        break;
+    }
+  }
+}
+
+// The uinput side.  Events are batched and written along with
+// their SYN_REPORT in a single write().
+static int uinputFd = -1;
+static struct input_event uinputEvents[64];
+static uint8_t numUinputEvents = 0;
+
+static void emit(uint16_t type, uint16_t code, int32_t value) {
+  if (numUinputEvents < sizeof(uinputEvents) / sizeof(uinputEvents[0]) - 1) {
+    auto &ev = uinputEvents[numUinputEvents++];
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+  }
+}
+
+static void flush() {
+  if (uinputFd < 0) {
+    // -t has no uinput device; the reports are all it looks at
+    numUinputEvents = 0;
+  }
+  if (!numUinputEvents) {
+    return;
+  }
+  emit(EV_SYN, SYN_REPORT, 0);
+  if (write(uinputFd, uinputEvents,
+            numUinputEvents * sizeof(uinputEvents[0])) < 0) {
+    perror("uinput write");
+  }
+  numUinputEvents = 0;
+}
+
+static bool openUinput() {
+  uinputFd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (uinputFd < 0) {
+    perror("/dev/uinput");
+    return false;
+  }
+  ioctl(uinputFd, UI_SET_EVBIT, EV_KEY);
+  ioctl(uinputFd, UI_SET_EVBIT, EV_REL);
+  // The kernel generates autorepeat for us
+  ioctl(uinputFd, UI_SET_EVBIT, EV_REP);
+  for (uint16_t code = KEY_ESC; code < BTN_MISC; ++code) {
+    ioctl(uinputFd, UI_SET_KEYBIT, code);
+  }
+  for (auto button : kMouseButtons) {
+    ioctl(uinputFd, UI_SET_KEYBIT, button);
+  }
+  ioctl(uinputFd, UI_SET_RELBIT, REL_X);
+  ioctl(uinputFd, UI_SET_RELBIT, REL_Y);
+  ioctl(uinputFd, UI_SET_RELBIT, REL_WHEEL);
+
+  struct uinput_setup setup;
+  memset(&setup, 0, sizeof(setup));
+  setup.id.bustype = BUS_VIRTUAL;
+  strcpy(setup.name, "Spock keymap engine");
+  if (ioctl(uinputFd, UI_DEV_SETUP, &setup) < 0 ||
+      ioctl(uinputFd, UI_DEV_CREATE) < 0) {
+    perror("uinput setup");
+    return false;
+  }
+  return true;
+}
+
+// The engine talks to Keyboard; here it turns the reports back
+// into key transitions
+static KeyReport uinputKeys;
+static ConsumerReport uinputConsumer;
+static MouseReport uinputMouse;
+
+static bool reportHasKey(const KeyReport &report, uint8_t key) {
+  for (auto k : report.keys) {
+    if (k == key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Emits the keys in from that aren't in to, as value
+static void emitKeyDiff(const KeyReport &from, const KeyReport &to,
+                        int32_t value) {
+  uint8_t mods = from.modifiers & ~to.modifiers;
+  for (; mods; mods &= mods - 1) {
+    emit(EV_KEY, codeForUsage[0xe0 + __builtin_ctz(mods)], value);
+  }
+  for (auto k : from.keys) {
+    if (k && codeForUsage[k] && !reportHasKey(to, k)) {
+      emit(EV_KEY, codeForUsage[k], value);
+    }
+  }
+}
+
+Keyboard_::Keyboard_(void) {}
+void Keyboard_::begin(void) {}
+void Keyboard_::end(void) {}
+
+void Keyboard_::sendReport(KeyReport *keys) {
+  // Releases go first, so that a modifier is never briefly
+  // applied to a key that it doesn't belong with
+  emitKeyDiff(uinputKeys, *keys, 0);
+  emitKeyDiff(*keys, uinputKeys, 1);
+  uinputKeys = *keys;
+  flush();
+}
+
+void Keyboard_::sendConsumerReport(ConsumerReport *report) {
+  if (report->usage != uinputConsumer.usage) {
+    if (auto code = codeForConsumer(uinputConsumer.usage)) {
+      emit(EV_KEY, code, 0);
+    }
+    if (auto code = codeForConsumer(report->usage)) {
+      emit(EV_KEY, code, 1);
+    }
+  }
+  uinputConsumer = *report;
+  flush();
+}
+
+void Keyboard_::sendMouseReport(MouseReport *report) {
+  uint8_t changed = report->buttons ^ uinputMouse.buttons;
+  for (uint8_t i = 0; i < sizeof(kMouseButtons) / sizeof(kMouseButtons[0]);
+       ++i) {
+    if (changed & (1 << i)) {
+      emit(EV_KEY, kMouseButtons[i], (report->buttons >> i) & 1);
+    }
+  }
+  if (report->x) {
+    emit(EV_REL, REL_X, report->x);
+  }
+  if (report->y) {
+    emit(EV_REL, REL_Y, report->y);
+  }
+  if (report->wheel) {
+    emit(EV_REL, REL_WHEEL, report->wheel);
+  }
+  uinputMouse = *report;
+  flush();
+}
+
+static VendorReceiver vendorReceiver;
+static KeymapStatusReport keymapStatus;
+
+void Keyboard_::sendVendorReport(VendorReport *report) {
+  if (report->kind == kVendorKeymapStatus) {
+    memcpy(&keymapStatus, report->data, sizeof(keymapStatus));
+  }
+}
+
+void Keyboard_::setVendorReceiver(VendorReceiver receiver) {
+  vendorReceiver = receiver;
+}
+
+void Keyboard_::releaseAll(void) {
+  KeyReport keys;
+  ConsumerReport consumer;
+  MouseReport mouse;
+  memset(&keys, 0, sizeof(keys));
+  memset(&consumer, 0, sizeof(consumer));
+  memset(&mouse, 0, sizeof(mouse));
+  sendReport(&keys);
+  sendConsumerReport(&consumer);
+  sendMouseReport(&mouse);
+}
+
+Keyboard_ Keyboard;
+
+// There is no replay driver here
+void requestTraceReplay() {}
+void requestSyntheticReplay() {}
+void requestPropertyCheck() {}
+
+static LatencyStats eventLatency;
+static bool verbose = false;
+
+static matrix_t matrix = {};
+static usec_t lastPass = 0;
+static int timerFd = -1;
+
+// Runs the engine over the matrix as of now, then keeps the mouse
+// frame timer running for as long as the pointer is moving
+static void runPass(usec_t now) {
+  // Event timestamps can trail a timer pass; the engine needs a
+  // clock that never goes backwards
+  if (now < lastPass) {
+    now = lastPass;
+  }
+  lastPass = now;
+  timebaseMockNow = now;
+
+  processMatrix(matrix, now);
+  if (last_was_tap) {
+    // Release the tapped key straight away rather than on the
+    // next event
+    processMatrix(matrix, now);
+  }
+  updateMouse(now);
+  runPendingMacros();
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (mouseMotion.moving) {
+    spec.it_value.tv_nsec = kMouseFrame * 1000;
+    spec.it_interval.tv_nsec = kMouseFrame * 1000;
+  }
+  timerfd_settime(timerFd, 0, &spec, nullptr);
+}
+
+static usec_t eventTime(const struct input_event &ev) {
+  return usec_t(ev.input_event_sec) * 1000000 + ev.input_event_usec;
+}
+
+// Re-reads the key state after the kernel dropped events
+static void resyncMatrix(int fd) {
+  uint8_t keys[KEY_CNT / 8];
+  memset(keys, 0, sizeof(keys));
+  ioctl(fd, EVIOCGKEY(sizeof(keys)), keys);
+  memset(&matrix, 0, sizeof(matrix));
+  for (uint16_t code = 0; code < KEY_CNT; ++code) {
+    if (scanCodeForCode[code] != kNoScanCode &&
+        (keys[code / 8] >> (code % 8)) & 1) {
+      matrix.set(scanCodeForCode[code], true);
+    }
+  }
+}
+
+// The key events since the last SYN_REPORT
+static usec_t frameTimes[16];
+static uint16_t frameCodes[16];
+static int32_t frameValues[16];
+static uint8_t frameEvents = 0;
+static bool dropping = false;
+
+static void handleEvent(int fd, const struct input_event &ev) {
+  if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+    dropping = true;
+    return;
+  }
+  if (dropping) {
+    // Ignore everything up to the next SYN_REPORT, then resync
+    if (ev.type == EV_SYN && ev.code == SYN_REPORT) {
+      dropping = false;
+      frameEvents = 0;
+      resyncMatrix(fd);
+      runPass(monotonicMicros());
+    }
+    return;
+  }
+
+  if (ev.type == EV_KEY && ev.code < KEY_CNT && ev.value != 2) {
+    auto scanCode = scanCodeForCode[ev.code];
+    if (scanCode == kNoScanCode) {
+      emit(EV_KEY, ev.code, ev.value);
+      flush();
+      return;
+    }
+    matrix.set(scanCode, ev.value);
+    if (frameEvents < sizeof(frameTimes) / sizeof(frameTimes[0])) {
+      frameTimes[frameEvents] = eventTime(ev);
+      frameCodes[frameEvents] = ev.code;
+      frameValues[frameEvents] = ev.value;
+      ++frameEvents;
+    }
+    return;
+  }
+
+  if (ev.type == EV_SYN && ev.code == SYN_REPORT && frameEvents) {
+    runPass(eventTime(ev));
+    auto done = monotonicMicros();
+    for (uint8_t i = 0; i < frameEvents; ++i) {
+      uint32_t latency = done > frameTimes[i] ? done - frameTimes[i] : 0;
+      recordLatency(eventLatency, latency);
+      if (verbose) {
+        fprintf(stderr, "key %u %s: %uus\n", frameCodes[i],
+                frameValues[i] ? "down" : "up", latency);
+      }
+    }
+    frameEvents = 0;
+  }
+}
+
+// Feeds the reports in path to hotswap.h as if they had come from
+// the host, and swaps the keymap in between two passes
+static bool loadKeymap(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint8_t buf[1 + sizeof(VendorReport)];
+  while (fread(buf, sizeof(buf), 1, f) == 1) {
+    VendorReport report;
+    memcpy(&report, &buf[1], sizeof(report));
+    vendorReceiver(&report);
+  }
+  fclose(f);
+  keymapStatus.status = 0xff;
+  applyLoadedKeymap();
+  static const char *const kStatus[] = {"ok", "bad crc", "missing chunks",
+                                        "bad layers", "bad opcode"};
+  fprintf(stderr, "%s: %s, %d layers, crc %08x\n", path,
+          keymapStatus.status < sizeof(kStatus) / sizeof(kStatus[0])
+              ? kStatus[keymapStatus.status]
+              : "no reply",
+          keymapStatus.layers, keymapStatus.crc);
+  return keymapStatus.status == kKeymapOk;
+}
+
+// Returns the first scan code whose action on layer has opcode,
+// other than those in used
+static uint8_t findTestKey(uint8_t layer, action_t opcode,
+                           const uint8_t *used, uint8_t numUsed) {
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    bool taken = false;
+    for (uint8_t i = 0; i < numUsed; ++i) {
+      taken |= used[i] == scanCode;
+    }
+    if (!taken && (keymap[layer][scanCode] & kMask) == opcode) {
+      return scanCode;
+    }
+  }
+  fprintf(stderr, "the keymap has no key for the test\n");
+  exit(1);
+}
+
+static bool reportEmpty(const KeyReport &report) {
+  bool empty = !report.modifiers;
+  for (auto k : report.keys) {
+    empty &= !k;
+  }
+  return empty;
+}
+
+// Holds keys on the built in keymap, swaps in the keymap in path and
+// checks that releasing the keys leaves nothing pressed
+static bool testHeldSwap(const char *path) {
+  uint8_t keys[4];
+  keys[0] = findTestKey(0, kModifier, keys, 0);
+  keys[1] = findTestKey(0, kKeyPress, keys, 1);
+  keys[2] = findTestKey(0, kLayer, keys, 2);
+  keys[3] = findTestKey(keymap[0][keys[2]] & 0xff, kKeyPress, keys, 3);
+
+  usec_t now = monotonicMicros();
+  resetKeyMatrix();
+  for (auto scanCode : keys) {
+    matrix.set(scanCode, true);
+    runPass(now += 20000);
+  }
+  bool ok = true;
+  if (!uinputKeys.modifiers || !reportHasKey(uinputKeys, keymap[0][keys[1]]) ||
+      !reportHasKey(uinputKeys, keymap[keymap[0][keys[2]] & 0xff][keys[3]])) {
+    fprintf(stderr, "the held keys are missing from the report\n");
+    ok = false;
+  }
+
+  if (!loadKeymap(path)) {
+    return false;
+  }
+  runPass(now += 20000);
+  // The layer key goes first, while the key on its layer is held
+  static const uint8_t kReleaseOrder[] = {2, 3, 1, 0};
+  for (auto i : kReleaseOrder) {
+    matrix.set(keys[i], false);
+    runPass(now += 20000);
+  }
+  runPass(now += 20000);
+
+  if (!reportEmpty(uinputKeys) || layer_pos != 0 || keyStates.down) {
+    fprintf(stderr,
+            "keys still down after the swap: mods=%02x keys=%02x %02x %02x "
+            "%02x %02x %02x layers=%u\n",
+            uinputKeys.modifiers, uinputKeys.keys[0], uinputKeys.keys[1],
+            uinputKeys.keys[2], uinputKeys.keys[3], uinputKeys.keys[4],
+            uinputKeys.keys[5], layer_pos);
+    ok = false;
+  }
+  fprintf(stderr, "held swap: %s\n", ok ? "ok" : "FAILED");
+  return ok;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-v] [-m CODE=SCANCODE]... [-k KEYMAP] DEVICE\n"
+          "       %s [-t] -k KEYMAP\n",
+          argv0, argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  buildKeyMap();
+  initHotswap();
+
+  const char *keymapPath = nullptr;
+  bool selfTest = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "vtm:k:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = true;
+        break;
+      case 't':
+        selfTest = true;
+        break;
+      case 'k':
+        keymapPath = optarg;
+        break;
+      case 'm': {
+        unsigned code, scanCode;
+        if (sscanf(optarg, "%u=%u", &code, &scanCode) != 2 ||
+            code >= KEY_CNT || scanCode >= matrix_t::kKeys) {
+          usage(argv[0]);
+        }
+        scanCodeForCode[code] = scanCode;
+        break;
+      }
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (selfTest) {
+    if (!keymapPath || optind != argc) {
+      usage(argv[0]);
+    }
+    return testHeldSwap(keymapPath) ? 0 : 1;
+  }
+  if (keymapPath && optind == argc) {
+    return loadKeymap(keymapPath) ? 0 : 1;
+  }
+  if (optind + 1 != argc) {
+    usage(argv[0]);
+  }
+  if (keymapPath && !loadKeymap(keymapPath)) {
+    return 1;
+  }
+
+  int evdevFd = open(argv[optind], O_RDONLY | O_NONBLOCK);
+  if (evdevFd < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  // Timestamp events on the same clock as monotonicMicros()
+  int clockId = CLOCK_MONOTONIC;
+  if (ioctl(evdevFd, EVIOCSCLOCKID, &clockId) < 0) {
+    perror("EVIOCSCLOCKID");
+    return 1;
+  }
+  if (!openUinput()) {
+    return 1;
+  }
+  // Give the new device a moment to appear before we take the
+  // keyboard away, so that the release of the key that started
+  // us isn't lost
+  usleep(200000);
+  if (ioctl(evdevFd, EVIOCGRAB, 1) < 0) {
+    perror("EVIOCGRAB");
+    return 1;
+  }
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  sigprocmask(SIG_BLOCK, &signals, nullptr);
+  int signalFd = signalfd(-1, &signals, SFD_NONBLOCK);
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  int epollFd = epoll_create1(0);
+  int fds[] = {evdevFd, timerFd, signalFd};
+  for (int fd : fds) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  timebaseMockNow = monotonicMicros();
+  resetKeyMatrix();
+  resyncMatrix(evdevFd);
+  runPass(monotonicMicros());
+
+  bool running = true;
+  while (running) {
+    struct epoll_event ready[3];
+    int n = epoll_wait(epollFd, ready, 3, -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      int fd = ready[i].data.fd;
+      if (fd == evdevFd) {
+        struct input_event events[64];
+        ssize_t len;
+        while ((len = read(evdevFd, events, sizeof(events))) > 0) {
+          for (size_t e = 0; e < len / sizeof(events[0]); ++e) {
+            handleEvent(evdevFd, events[e]);
+          }
+        }
+        if (len < 0 && errno == ENODEV) {
+          fprintf(stderr, "%s: device went away\n", argv[optind]);
+          running = false;
+        }
+      } else if (fd == timerFd) {
+        uint64_t expirations;
+        if (read(timerFd, &expirations, sizeof(expirations)) > 0) {
+          runPass(monotonicMicros());
+        }
+      } else if (fd == signalFd) {
+        struct signalfd_siginfo info;
+        if (read(signalFd, &info, sizeof(info)) == sizeof(info) &&
+            info.ssi_signo == SIGHUP) {
+          if (keymapPath) {
+            loadKeymap(keymapPath);
+          }
+        } else {
+          running = false;
+        }
+      }
+    }
+  }
+
+  memset(&matrix, 0, sizeof(matrix));
+  runPass(monotonicMicros());
+  Keyboard.releaseAll();
+  ioctl(evdevFd, EVIOCGRAB, 0);
+  ioctl(uinputFd, UI_DEV_DESTROY);
+  printLatency(eventLatency);
+  return 0;
+}
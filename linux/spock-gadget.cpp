@@ -0,0 +1,454 @@
+// spock-gadget measures the latency of the whole report path, from
+// a change in the matrix to the input event that the host sees.
+// It runs the keymap engine and the firmware's own Keyboard.cpp,
+// whose reports go out through a Linux USB gadget: a ConfigFS HID
+// function, with the same report descriptor as the firmware, bound
+// to a UDC.  With the dummy_hcd module loaded the UDC is a virtual
+// one and the host side of it is this same machine, so the gadget
+// enumerates as a real USB keyboard that we can read back through
+// evdev, with no hardware at all:
+//
+//   sudo modprobe dummy_hcd && sudo modprobe libcomposite
+//   make && sudo ./spock-gadget -n 1000
+//
+// We press and release random keys of layer 0 and time each one
+// from the pass that saw it to the kernel's timestamp on the host
+// input event.  That takes in the engine, the gadget driver, the
+// USB polling interval (dummy_hcd runs at high speed, where f_hid
+// asks for a 1ms interval) and the host's HID and input layers.
+//
+// Output reports from the host go back through Keyboard.cpp to
+// hotswap.h, so tools/spock-keymap.py can load a keymap into the
+// gadget through its hidraw node while it runs.
+
+#define TIMEBASE_MOCK 1
+#define HOTSWAP 1
+
+#include "Arduino.h"
+#include "Keyboard.h"
+#include "keycodes.h"
+#include "timebase.h"
+#include "instrument.h"
+#include "log.h"
+#include "trace.h"
+#include "matrix.h"
+#include "keymap.h"
+#include "mouse.h"
+#include "usage.h"
+#include "hotswap.h"
+#include "hidcodes.h"
+#include "latency.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// The gadget's identity: the Linux Foundation's multifunction
+// composite gadget, so that it can't be mistaken for the keyboard
+static constexpr uint16_t kGadgetVendor = 0x1d6b;
+static constexpr uint16_t kGadgetProduct = 0x0104;
+static constexpr uint16_t kReportLength = 1 + sizeof(VendorReport);
+static const char kConfigFs[] = "/sys/kernel/config/usb_gadget/";
+
+// The HID library, over /dev/hidgN
+static int hidgFd = -1;
+static int hidgReadFd = -1;
+static HID_ *pluggedHid = nullptr;
+static const uint8_t *controlData;
+static uint16_t controlLength;
+
+HID_::HID_(void) {
+  pluggedHid = this;
+}
+
+int HID_::SendReport(uint8_t id, const void *data, int len) {
+  uint8_t buf[kReportLength];
+  buf[0] = id;
+  memcpy(&buf[1], data, len);
+  if (hidgFd < 0) {
+    return -1;
+  }
+  return write(hidgFd, buf, len + 1);
+}
+
+void HID_::AppendDescriptor(HIDSubDescriptor *node) {
+  auto *tail = &rootNode;
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = node;
+}
+
+uint16_t HID_::reportDescriptor(uint8_t *buf, uint16_t size) {
+  uint16_t len = 0;
+  for (auto node = rootNode; node; node = node->next) {
+    if (len + node->length > size) {
+      return 0;
+    }
+    memcpy(buf + len, node->data, node->length);
+    len += node->length;
+  }
+  return len;
+}
+
+int HID_::getInterface(uint8_t *) {
+  return 0;
+}
+
+bool HID_::setup(USBSetup &) {
+  return false;
+}
+
+int USBDeviceClass::sendControl(const void *, uint32_t len) {
+  return len;
+}
+
+uint32_t USBDeviceClass::recvControl(void *data, uint32_t len) {
+  if (len > controlLength) {
+    len = controlLength;
+  }
+  memcpy(data, controlData, len);
+  return len;
+}
+
+bool USBDeviceClass::setReport(const uint8_t *report, uint16_t len) {
+  PluggableUSBModule *module = pluggedHid;
+  if (!module || !len) {
+    return false;
+  }
+  USBSetup setup = {REQUEST_HOSTTODEVICE_CLASS_INTERFACE,
+                    HID_SET_REPORT,
+                    report[0],
+                    2, // output
+                    module->pluggedInterface,
+                    len};
+  controlData = report;
+  controlLength = len;
+  return module->setup(setup);
+}
+
+USBDeviceClass USBDevice;
+
+// There is no replay driver here
+void requestTraceReplay() {}
+void requestSyntheticReplay() {}
+void requestPropertyCheck() {}
+
+// ConfigFS
+static std::string gadgetDir;
+
+static bool writeFile(const std::string &path, const void *data,
+                      size_t len) {
+  int fd = open(path.c_str(), O_WRONLY);
+  if (fd < 0 || write(fd, data, len) != ssize_t(len)) {
+    perror(path.c_str());
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  close(fd);
+  return true;
+}
+
+static bool writeString(const std::string &path, const std::string &value) {
+  return writeFile(gadgetDir + path, value.data(), value.size());
+}
+
+static bool makeDir(const std::string &path) {
+  if (mkdir((gadgetDir + path).c_str(), 0755) < 0 && errno != EEXIST) {
+    perror((gadgetDir + path).c_str());
+    return false;
+  }
+  return true;
+}
+
+static std::string hexString(uint16_t value) {
+  char buf[8];
+  snprintf(buf, sizeof(buf), "0x%04x", value);
+  return buf;
+}
+
+// Returns the first UDC, which is dummy_udc.0 when only dummy_hcd
+// provides one
+static std::string firstUdc() {
+  std::string udc;
+  if (DIR *dir = opendir("/sys/class/udc")) {
+    while (auto ent = readdir(dir)) {
+      if (ent->d_name[0] != '.') {
+        udc = ent->d_name;
+        break;
+      }
+    }
+    closedir(dir);
+  }
+  return udc;
+}
+
+static void removeGadget() {
+  if (gadgetDir.empty() || access(gadgetDir.c_str(), F_OK) < 0) {
+    return;
+  }
+  writeString("UDC", "\n");
+  unlink((gadgetDir + "configs/c.1/hid.usb0").c_str());
+  rmdir((gadgetDir + "configs/c.1/strings/0x409").c_str());
+  rmdir((gadgetDir + "configs/c.1").c_str());
+  rmdir((gadgetDir + "functions/hid.usb0").c_str());
+  rmdir((gadgetDir + "strings/0x409").c_str());
+  rmdir(gadgetDir.c_str());
+  gadgetDir.clear();
+}
+
+// Creates the gadget, binds it to udc and opens its /dev/hidgN
+static bool createGadget(const std::string &name, const std::string &udc) {
+  uint8_t desc[512];
+  uint16_t descLen = pluggedHid->reportDescriptor(desc, sizeof(desc));
+
+  gadgetDir = kConfigFs + name + "/";
+  if (!makeDir("") || !writeString("idVendor", hexString(kGadgetVendor)) ||
+      !writeString("idProduct", hexString(kGadgetProduct)) ||
+      !writeString("bcdDevice", "0x0100") ||
+      !writeString("bcdUSB", "0x0200") || !makeDir("strings/0x409") ||
+      !writeString("strings/0x409/manufacturer", "Spock") ||
+      !writeString("strings/0x409/product", "Spock Gadget") ||
+      !writeString("strings/0x409/serialnumber", "0") ||
+      !makeDir("configs/c.1") || !makeDir("configs/c.1/strings/0x409") ||
+      !writeString("configs/c.1/strings/0x409/configuration", "Spockduino") ||
+      !writeString("configs/c.1/MaxPower", "100") ||
+      !makeDir("functions/hid.usb0") ||
+      !writeString("functions/hid.usb0/protocol", "0") ||
+      !writeString("functions/hid.usb0/subclass", "0") ||
+      !writeString("functions/hid.usb0/report_length",
+                   std::to_string(EPX_SIZE)) ||
+      !writeFile(gadgetDir + "functions/hid.usb0/report_desc", desc,
+                 descLen)) {
+    return false;
+  }
+  if (symlink((gadgetDir + "functions/hid.usb0").c_str(),
+              (gadgetDir + "configs/c.1/hid.usb0").c_str()) < 0 &&
+      errno != EEXIST) {
+    perror("symlink");
+    return false;
+  }
+  if (!writeString("UDC", udc)) {
+    return false;
+  }
+
+  // The function tells us which hidg minor it got
+  char dev[32] = {};
+  int fd = open((gadgetDir + "functions/hid.usb0/dev").c_str(), O_RDONLY);
+  unsigned major, minor;
+  if (fd < 0 || read(fd, dev, sizeof(dev) - 1) <= 0 ||
+      sscanf(dev, "%u:%u", &major, &minor) != 2) {
+    fprintf(stderr, "can't find the hidg device\n");
+    return false;
+  }
+  close(fd);
+  auto path = "/dev/hidg" + std::to_string(minor);
+  hidgFd = open(path.c_str(), O_WRONLY);
+  hidgReadFd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (hidgFd < 0 || hidgReadFd < 0) {
+    perror(path.c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool hasKey(int fd, uint16_t code) {
+  uint8_t keys[KEY_CNT / 8] = {};
+  return ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) >= 0 &&
+         (keys[code / 8] >> (code % 8)) & 1;
+}
+
+// Finds the host's keyboard input device for the gadget, waiting
+// for it to enumerate
+static int openHostKeyboard() {
+  for (int tries = 0; tries < 50; ++tries) {
+    if (DIR *dir = opendir("/dev/input")) {
+      while (auto ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "event", 5) != 0) {
+          continue;
+        }
+        auto path = std::string("/dev/input/") + ent->d_name;
+        int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+        struct input_id id;
+        if (fd >= 0 && ioctl(fd, EVIOCGID, &id) >= 0 &&
+            id.vendor == kGadgetVendor && id.product == kGadgetProduct &&
+            hasKey(fd, KEY_A)) {
+          closedir(dir);
+          int clockId = CLOCK_MONOTONIC;
+          ioctl(fd, EVIOCSCLOCKID, &clockId);
+          fprintf(stderr, "host keyboard: %s\n", path.c_str());
+          return fd;
+        }
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+      closedir(dir);
+    }
+    usleep(100000);
+  }
+  fprintf(stderr, "the gadget didn't show up as a host keyboard\n");
+  return -1;
+}
+
+static matrix_t matrix = {};
+static uint16_t codeForUsage[256];
+
+static void runPass(usec_t now) {
+  timebaseMockNow = now;
+  processMatrix(matrix, now);
+  if (last_was_tap) {
+    processMatrix(matrix, now);
+  }
+}
+
+// Hands any output reports from the host to Keyboard.cpp
+static void serviceOutputReports() {
+  uint8_t report[EPX_SIZE];
+  ssize_t len;
+  while ((len = read(hidgReadFd, report, sizeof(report))) > 0) {
+    USBDevice.setReport(report, len);
+  }
+  applyLoadedKeymap();
+}
+
+// Waits for the host to deliver code going to value; returns its
+// timestamp, or 0 if it never came
+static usec_t waitForHostKey(int fd, uint16_t code, int32_t value) {
+  auto deadline = monotonicMicros() + 1000000;
+  while (monotonicMicros() < deadline) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 100) <= 0) {
+      continue;
+    }
+    struct input_event ev;
+    while (read(fd, &ev, sizeof(ev)) == sizeof(ev)) {
+      if (ev.type == EV_KEY && ev.code == code && ev.value == value) {
+        return usec_t(ev.input_event_sec) * 1000000 + ev.input_event_usec;
+      }
+    }
+  }
+  return 0;
+}
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int) {
+  stopping = 1;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-v] [-n KEYSTROKES] [-i INTERVAL_MS] [-u UDC] "
+          "[-g NAME]\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  uint32_t keystrokes = 500;
+  uint32_t interval = 20;
+  bool verbose = false;
+  std::string udc = firstUdc();
+  std::string name = "spock";
+  int opt;
+  while ((opt = getopt(argc, argv, "vn:i:u:g:")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = true;
+        break;
+      case 'n':
+        keystrokes = atoi(optarg);
+        break;
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      case 'u':
+        udc = optarg;
+        break;
+      case 'g':
+        name = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (udc.empty()) {
+    fprintf(stderr, "no UDC; is dummy_hcd loaded?\n");
+    return 1;
+  }
+
+  // The keys that we can press: plain keys of layer 0 that the
+  // host will report
+  for (auto &u : kKeyboardUsages) {
+    codeForUsage[u.usage] = u.code;
+  }
+  std::vector<uint8_t> scanCodes;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    auto action = keymap[0][scanCode];
+    if ((action & kMask) == kKeyPress && codeForUsage[action & 0xff]) {
+      scanCodes.push_back(scanCode);
+    }
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  initHotswap();
+  int hostFd = -1;
+  if (!createGadget(name, udc) || (hostFd = openHostKeyboard()) < 0) {
+    removeGadget();
+    return 1;
+  }
+  timebaseMockNow = monotonicMicros();
+  resetKeyMatrix();
+
+  LatencyStats latency = {};
+  uint32_t lost = 0;
+  for (uint32_t n = 0; n < keystrokes && !stopping; ++n) {
+    uint8_t scanCode = scanCodes[rand() % scanCodes.size()];
+    for (int32_t value = 1; value >= 0 && !stopping; --value) {
+      matrix.set(scanCode, value);
+      auto start = monotonicMicros();
+      runPass(start);
+      // The action can change under us with a loaded keymap
+      auto action = resolveActionForScanCodeOnActiveLayer(scanCode);
+      auto code = (action & kMask) == kKeyPress ? codeForUsage[action & 0xff]
+                                                : 0;
+      auto seen = code ? waitForHostKey(hostFd, code, value) : 0;
+      if (seen) {
+        uint32_t elapsed = seen > start ? seen - start : 0;
+        recordLatency(latency, elapsed);
+        if (verbose) {
+          fprintf(stderr, "scan code %u %s: %uus\n", scanCode,
+                  value ? "down" : "up", elapsed);
+        }
+      } else if (code) {
+        ++lost;
+      }
+      serviceOutputReports();
+      usleep(interval * 1000);
+    }
+  }
+
+  memset(&matrix, 0, sizeof(matrix));
+  runPass(monotonicMicros());
+  printLatency(latency);
+  if (lost) {
+    fprintf(stderr, "lost: %u\n", lost);
+  }
+  close(hostFd);
+  close(hidgFd);
+  close(hidgReadFd);
+  removeGadget();
+  return lost ? 1 : 0;
+}
@@ -0,0 +1,461 @@
+// spock-replay runs the replay driver of replay.h on the host, so
+// that a change to the keymap engine can be checked against what
+// it used to do before it goes anywhere near a keyboard.
+//
+// Given a FILE, we replay the trace in it (as written by
+// tools/spock-trace.py --raw, or by -w) and compare every report
+// with the hash recorded alongside it, exiting non-zero on any
+// mismatch.  testdata/session.trace is the golden trace that make
+// check replays.  -s runs the synthetic roll, tap-hold and mouse
+// workloads, and fails if the mouse motion is rougher than the
+// bounds in replay.h; -p runs the property checks, which also exit
+// non-zero when they find anything.  -m checks that every macro key
+// queues its macro exactly once, on the press, and none on the
+// release; the random workloads leave macros out.
+//
+// -b measures what the keymap engine costs: the size of its key
+// state and the time that a pass of processMatrix() takes with
+// nothing changed (most passes at the scan rate), while typing a
+// roll and with ten keys held while another is tapped.  Each figure
+// is the best of several runs, in nanoseconds per pass.
+//
+// -w FILE records a new golden trace: a fixed run of tap-hold and
+// macro presses, then a seeded random session of rolls, shifted
+// keys, tap-hold taps and holds, keys on layer 1 and macros, runs
+// through processMatrix() with the trace on, and the ring is written
+// out in the format of a serial dump.  Only do this when the engine
+// is meant to change what it reports.  testdata/session.trace was
+// recorded from the same session, seed 1, with the engine as it was
+// before its key state moved to parallel arrays and its actions to
+// a dispatch table, so it holds the reports of the older engine.
+//
+//   make spock-replay && ./spock-replay testdata/session.trace
+
+#define TIMEBASE_MOCK 1
+#define TRACE 1
+#define REPLAY 1
+
+#include "Arduino.h"
+#include "Keyboard.h"
+#include "keycodes.h"
+#include "timebase.h"
+#include "instrument.h"
+#include "log.h"
+#include "trace.h"
+#include "matrix.h"
+#include "keymap.h"
+#include "mouse.h"
+#include "usage.h"
+#include "replay.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+// The reports go nowhere; replay.h captures the ones that it needs
+Keyboard_::Keyboard_(void) {}
+void Keyboard_::begin(void) {}
+void Keyboard_::end(void) {}
+void Keyboard_::releaseAll(void) {}
+void Keyboard_::sendReport(KeyReport *) {}
+void Keyboard_::sendConsumerReport(ConsumerReport *) {}
+void Keyboard_::sendMouseReport(MouseReport *) {}
+void Keyboard_::sendVendorReport(VendorReport *) {}
+void Keyboard_::setVendorReceiver(VendorReceiver) {}
+
+Keyboard_ Keyboard;
+
+static bool readTrace(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  TraceHeader header;
+  bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+            header.magic == kTraceMagic && header.count <= kTraceSize &&
+            header.recordSize == sizeof(TraceRecord) &&
+            fread(traceBuffer.records, sizeof(TraceRecord), header.count, f) ==
+                header.count;
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "%s: not a trace dump\n", path);
+    return false;
+  }
+  traceBuffer.magic = kTraceMagic;
+  traceBuffer.head = header.count & (kTraceSize - 1);
+  traceBuffer.count = header.count;
+  return true;
+}
+
+static bool writeTrace(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  TraceHeader header = {kTraceMagic, traceBuffer.count, sizeof(TraceRecord)};
+  uint16_t first = (traceBuffer.head - traceBuffer.count) & (kTraceSize - 1);
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  for (uint16_t n = 0; n < header.count && ok; ++n) {
+    ok = fwrite(&traceBuffer.records[(first + n) & (kTraceSize - 1)],
+                sizeof(TraceRecord), 1, f) == 1;
+  }
+  if (fclose(f) != 0 || !ok) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+// The recorder's matrix and clock
+static matrix_t matrix = {};
+static usec_t now = 1000000;
+
+// Moves the clock on and runs a pass with scanCode changed, as the
+// firmware would
+static void recordEvent(uint8_t scanCode, bool down, uint32_t after) {
+  now += after;
+  timebaseMockNow = now;
+  matrix.set(scanCode, down);
+  processMatrix(matrix, now);
+  if (last_was_tap) {
+    processMatrix(matrix, ++now);
+  }
+}
+
+static uint8_t pick(const uint8_t *codes, uint8_t n) {
+  return codes[rand() % n];
+}
+
+static uint32_t pickInterval() {
+  static const uint32_t intervals[] = {
+      15000, 40000, 60000, 120000, kTapInterval - 10000, kTapInterval + 10000};
+  return intervals[rand() % (sizeof(intervals) / sizeof(intervals[0]))];
+}
+
+// The first scan code whose action on layer is a macro, or kNoSlot
+static uint8_t findMacro(uint8_t layer) {
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    if ((activeKeymap[layer][scanCode] & kMask) == kMacro) {
+      return scanCode;
+    }
+  }
+  return kNoSlot;
+}
+
+static void recordSession(unsigned seed) {
+  uint8_t letters[26], shifts[2], tapHolds[2], layers[2];
+  uint8_t keys[matrix_t::kKeys];
+  auto numLetters = findScanCodes(kKeyPress, letters, sizeof(letters),
+                                  HID_KEYBOARD_A, HID_KEYBOARD_Z);
+  auto numShifts = findScanCodes(kModifier, shifts, sizeof(shifts),
+                                 KEYBOARD_MODIFIER_LEFTSHIFT,
+                                 KEYBOARD_MODIFIER_LEFTSHIFT);
+  auto numTapHolds = findScanCodes(kTapHold, tapHolds, sizeof(tapHolds));
+  auto numLayers = findScanCodes(kLayer, layers, sizeof(layers));
+  auto layerNum = numLayers ? activeKeymap[0][layers[0]] & 0xff : 0;
+  auto macro = layerNum < activeLayers ? findMacro(layerNum) : kNoSlot;
+  // Anything but macros, which have sections of their own, and mouse
+  // and media keys, whose reports the trace doesn't record
+  uint8_t numKeys = 0, layerKey = kNoSlot;
+  for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    bool skip = (activeKeymap[0][scanCode] & kMask) == kLayer;
+    for (uint8_t layer = 0; layer < activeLayers; ++layer) {
+      auto action = activeKeymap[layer][scanCode];
+      skip |= (action & kMask) == kMacro || hasOwnReport(action);
+    }
+    if (!skip) {
+      keys[numKeys++] = scanCode;
+      if (layerKey == kNoSlot && activeKeymap[layerNum][scanCode] != ___) {
+        layerKey = scanCode;
+      }
+    }
+  }
+  if (numLetters < 2 || !numShifts || !numTapHolds || !numLayers ||
+      macro == kNoSlot || layerKey == kNoSlot) {
+    fprintf(stderr, "the keymap is missing keys that the session needs\n");
+    exit(1);
+  }
+
+  srand(seed);
+  initTrace();
+
+  // First the keys that have handlers of their own.  A tap-hold key
+  // tapped just inside kTapInterval and held just past it, held
+  // under a letter, rolled out of before the letter and held under
+  // a layer key
+  auto tapHold = tapHolds[0], layer = layers[0];
+  auto letter = letters[0], other = letters[1];
+  recordEvent(tapHold, true, 40000);
+  recordEvent(tapHold, false, kTapInterval - 10000);
+  recordEvent(tapHold, true, 40000);
+  recordEvent(tapHold, false, kTapInterval + 10000);
+  recordEvent(tapHold, true, 40000);
+  recordEvent(letter, true, 40000);
+  recordEvent(letter, false, 40000);
+  recordEvent(tapHold, false, 40000);
+  recordEvent(tapHold, true, 40000);
+  recordEvent(letter, true, 60000);
+  recordEvent(tapHold, false, 60000);
+  recordEvent(letter, false, 40000);
+  recordEvent(tapHold, true, 40000);
+  recordEvent(layer, true, 40000);
+  recordEvent(layerKey, true, 40000);
+  recordEvent(layerKey, false, 40000);
+  recordEvent(layer, false, 40000);
+  recordEvent(tapHold, false, 40000);
+
+  // A macro on the layer, released before and after the layer key,
+  // and pressed while a letter is held and another rolls over it
+  recordEvent(layer, true, 40000);
+  recordEvent(macro, true, 60000);
+  recordEvent(macro, false, 60000);
+  recordEvent(layer, false, 40000);
+  recordEvent(layer, true, 40000);
+  recordEvent(macro, true, 60000);
+  recordEvent(layer, false, 60000);
+  recordEvent(macro, false, 40000);
+  recordEvent(letter, true, 40000);
+  recordEvent(layer, true, 40000);
+  recordEvent(macro, true, 40000);
+  recordEvent(other, true, 15000);
+  recordEvent(macro, false, 15000);
+  recordEvent(layer, false, 40000);
+  recordEvent(other, false, 40000);
+  recordEvent(letter, false, 40000);
+
+  // Then a random mix; each step adds at most six records
+  while (traceBuffer.count + 6 < kTraceSize) {
+    switch (rand() % 6) {
+      case 0: {
+        // A roll of three letters, each pressed before the last
+        // is released
+        auto a = pick(letters, numLetters), b = pick(letters, numLetters),
+             c = pick(letters, numLetters);
+        if (a == b || b == c || a == c) {
+          break;
+        }
+        recordEvent(a, true, pickInterval());
+        recordEvent(b, true, pickInterval());
+        recordEvent(a, false, pickInterval());
+        recordEvent(c, true, pickInterval());
+        recordEvent(b, false, pickInterval());
+        recordEvent(c, false, pickInterval());
+        break;
+      }
+      case 1: {
+        auto shift = pick(shifts, numShifts), letter = pick(letters, numLetters);
+        recordEvent(shift, true, pickInterval());
+        recordEvent(letter, true, pickInterval());
+        recordEvent(letter, false, pickInterval());
+        recordEvent(shift, false, pickInterval());
+        break;
+      }
+      case 2:
+        // A tap, or a hold if it crosses kTapInterval
+        recordEvent(tapHold, true, pickInterval());
+        recordEvent(tapHold, false, pickInterval());
+        break;
+      case 3: {
+        auto letter = pick(letters, numLetters);
+        recordEvent(tapHold, true, pickInterval());
+        recordEvent(letter, true, pickInterval());
+        recordEvent(letter, false, pickInterval());
+        recordEvent(tapHold, false, pickInterval());
+        break;
+      }
+      case 4: {
+        auto key = pick(keys, numKeys);
+        recordEvent(layer, true, pickInterval());
+        recordEvent(key, true, pickInterval());
+        recordEvent(key, false, pickInterval());
+        recordEvent(layer, false, pickInterval());
+        break;
+      }
+      case 5: {
+        // Either key may come up first
+        bool layerFirst = rand() % 2;
+        recordEvent(layer, true, pickInterval());
+        recordEvent(macro, true, pickInterval());
+        recordEvent(layerFirst ? layer : macro, false, pickInterval());
+        recordEvent(layerFirst ? macro : layer, false, pickInterval());
+        break;
+      }
+    }
+  }
+}
+
+// The passes that -b times: a key changes every changeEvery passes,
+// among the first numKeys letters, with held more keys held down
+static constexpr uint32_t kBenchPasses = 200000;
+static constexpr uint8_t kBenchRuns = 5;
+
+static uint32_t benchPasses(const uint8_t *letters, uint8_t numKeys,
+                            uint8_t held, uint32_t changeEvery) {
+  uint32_t best = UINT32_MAX;
+  for (uint8_t run = 0; run < kBenchRuns; ++run) {
+    resetKeyState();
+    matrix_t m = {};
+    for (uint8_t i = 0; i < held; ++i) {
+      m.set(letters[numKeys + i], true);
+    }
+    usec_t t = 0;
+    auto start = monotonicMicros();
+    for (uint32_t pass = 0; pass < kBenchPasses; ++pass) {
+      t += 1000;
+      if (changeEvery && pass % changeEvery == 0) {
+        m.toggle(letters[pass / changeEvery % numKeys]);
+      }
+      processMatrix(m, t);
+    }
+    auto elapsed = uint32_t((monotonicMicros() - start) * 1000 / kBenchPasses);
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+static void bench() {
+  uint8_t letters[26];
+  auto n = findScanCodes(kKeyPress, letters, sizeof(letters), HID_KEYBOARD_A,
+                         HID_KEYBOARD_Z);
+  if (n < 16) {
+    fprintf(stderr, "the keymap has too few letters to bench\n");
+    exit(1);
+  }
+  // Only the pass itself; the trace is for the other modes
+  pauseTrace(true);
+  printf("keyStates=%u bytes slots=%u\n", unsigned(sizeof(keyStates)),
+         unsigned(kNumSlots));
+  printf("idle: %u ns/pass\n", benchPasses(letters, 1, 0, 0));
+  printf("roll: %u ns/pass\n", benchPasses(letters, 6, 0, 1));
+  printf("held: %u ns/pass\n", benchPasses(letters, 1, 10, 2));
+}
+
+// Presses and releases each macro key in the keymap, with a key on
+// the base layer holding its layer, and checks what each pass queued
+// for runPendingMacros().  The layer key is let go first, so that a
+// release which resolved its action afresh would not find the macro.
+static bool checkMacros() {
+  uint8_t checked = 0, failed = 0;
+  for (uint8_t layer = 0; layer < activeLayers; ++layer) {
+    uint8_t layerKey = 0;
+    if (layer && !findScanCodes(kLayer, &layerKey, 1, layer, layer)) {
+      continue;
+    }
+    for (uint8_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+      auto action = activeKeymap[layer][scanCode];
+      if ((action & kMask) != kMacro) {
+        continue;
+      }
+      resetKeyState();
+      matrix_t m = {};
+      usec_t t = 1000000;
+      if (layer) {
+        m.set(layerKey, true);
+        processMatrix(m, t += 20000);
+      }
+      m.set(scanCode, true);
+      processMatrix(m, t += 20000);
+      bool queuedOnPress =
+          numPendingMacros == 1 && pendingMacros[0] == (action & 0xff);
+      numPendingMacros = 0;
+      if (layer) {
+        m.set(layerKey, false);
+        processMatrix(m, t += 20000);
+      }
+      m.set(scanCode, false);
+      processMatrix(m, t += 20000);
+      bool queuedOnRelease = numPendingMacros != 0;
+      numPendingMacros = 0;
+
+      ++checked;
+      if (!queuedOnPress || queuedOnRelease) {
+        fprintf(stderr, "MACRO(%u) on scan code %u: %s\n",
+                unsigned(action & 0xff), unsigned(scanCode),
+                queuedOnPress ? "queued again on the release"
+                              : "not queued once on the press");
+        ++failed;
+      }
+    }
+  }
+  if (!checked) {
+    fprintf(stderr, "the keymap has no macros to check\n");
+    return false;
+  }
+  printf("macros: checked=%u failed=%u\n", unsigned(checked), unsigned(failed));
+  return !failed;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s FILE\n"
+          "       %s -s | -p | -b | -m\n"
+          "       %s [-r SEED] -w FILE\n",
+          argv0, argv0, argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *recordPath = nullptr;
+  unsigned seed = 1;
+  ReplayKind kind = kReplayTrace;
+  int opt;
+  while ((opt = getopt(argc, argv, "spbmw:r:")) != -1) {
+    switch (opt) {
+      case 'b':
+        bench();
+        return 0;
+      case 'm':
+        return checkMacros() ? 0 : 1;
+      case 's':
+        kind = kReplaySynthetic;
+        break;
+      case 'p':
+        kind = kReplayProperties;
+        break;
+      case 'w':
+        recordPath = optarg;
+        break;
+      case 'r':
+        seed = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (recordPath) {
+    if (optind != argc) {
+      usage(argv[0]);
+    }
+    recordSession(seed);
+    if (!writeTrace(recordPath)) {
+      return 1;
+    }
+    fprintf(stderr, "recorded %u records\n", traceBuffer.count);
+    return 0;
+  }
+
+  if (optind + (kind == kReplayTrace) != argc) {
+    usage(argv[0]);
+  }
+  if (kind == kReplayTrace && !readTrace(argv[optind])) {
+    return 1;
+  }
+  replayRequested = kind;
+  runReplayIfRequested();
+
+  auto &r = replayResult;
+  if (kind == kReplayTrace && !r.compared) {
+    fprintf(stderr, "nothing to compare\n");
+    return 1;
+  }
+  if (kind == kReplaySynthetic && (r.mouseJerk > kReplayMouseMaxJerk ||
+                                   r.mouseStall > kReplayMouseMaxStall)) {
+    fprintf(stderr, "the mouse motion is rougher than it should be\n");
+    return 1;
+  }
+  return r.mismatches || r.stuck || r.layerBounds || r.reportSize ? 1 : 0;
+}
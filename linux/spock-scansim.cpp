@@ -0,0 +1,534 @@
+// spock-scansim runs the real key scanner against a simulated
+// keyboard, so that changes to the scanning (settle times, strobe
+// order, I2C traffic) can be checked without the hardware.
+//
+// The simulation is electrical rather than logical.  Each half of
+// the board has six row lines and seven column lines with a switch
+// and diode at every crossing, placed according to the KEYMAP
+// ordering in keymap.h.  The left half is wired to the Feather
+// pins in colPins and rowPins; the right half to an SX1509 whose
+// registers are modelled, driven through expRowPins and read
+// through expColPins.  A column that is let go by a low row or
+// pin takes its RC rise time to read high again, and switches
+// bounce for a while after every change.
+// Time is simulated too: pin operations, I2C transfers at the bus
+// clock and even calls to micros() cost what they would on the
+// Feather, so the scan times that we report are the ones that the
+// firmware would see.
+//
+// We type a random stream of keystrokes and check every scan
+// against the switches: a key that was steady for the whole scan
+// must read as it was.  A key read down that wasn't is a phantom,
+// which usually means that a column hadn't settled.
+//
+// For example, with slow expander columns on a fast bus the fixed
+// settle time is too short, while the calibrated one is not:
+//
+//   make spock-scansim && ./spock-scansim -r 100 -c 1000000 -f
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Keyboard.h"
+#include "keycodes.h"
+#include "timebase.h"
+#include "instrument.h"
+#include "log.h"
+#include "trace.h"
+#include "matrix.h"
+#include "keymap.h"
+#include "mouse.h"
+#include "chatter.h"
+#include "usage.h"
+#include "keyscanner.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+// What things cost on the Feather, in nanoseconds
+static constexpr uint32_t kPinCost = 1000;
+static constexpr uint32_t kPinModeCost = 2000;
+static constexpr uint32_t kMicrosCost = 500;
+
+static constexpr uint8_t kRowLines = 6;
+static constexpr uint8_t kColLines = 7;
+static constexpr uint64_t kNever = 0;
+
+// The simulated time
+static uint64_t simNanos = 1000000000;
+
+// One half of the board
+struct simhalf_t {
+  bool rowLow[kRowLines];   // row line driven low
+  bool colDriven[kColLines]; // column driven low by its own pin
+  bool closed[kRowLines][kColLines];
+  bool pulled[kColLines];   // column held low
+  uint64_t releasedAt[kColLines];
+  uint32_t rise[kColLines]; // nanoseconds to read high once let go
+};
+static simhalf_t halves[2];
+
+// Where each key of the KEYMAP ordering sits
+struct simkey_t {
+  uint8_t half;
+  uint8_t row;
+  uint8_t col;
+  uint8_t scanCode;
+  bool closed;
+  uint64_t lastChange;
+};
+static simkey_t keys[matrix_t::kKeys];
+
+// KEYMAP() places its arguments in matrix order, so passing it the
+// logical key numbers tells us which key is at each scan code
+static constexpr uint8_t kKeyAtScanCode[matrix_t::kKeys] = KEYMAP(
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+    20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37,
+    38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 52, 53, 54, 55,
+    56, 57, 58, 59, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73,
+    74, 75, 76, 77, 78, 79, 80, 81, 82, 83);
+
+static void updateColumn(simhalf_t &h, uint8_t col, uint64_t now) {
+  bool pulled = h.colDriven[col];
+  for (uint8_t row = 0; row < kRowLines; ++row) {
+    pulled |= h.closed[row][col] && h.rowLow[row];
+  }
+  if (h.pulled[col] && !pulled) {
+    h.releasedAt[col] = now;
+  }
+  h.pulled[col] = pulled;
+}
+
+static void updateHalf(simhalf_t &h) {
+  for (uint8_t col = 0; col < kColLines; ++col) {
+    updateColumn(h, col, simNanos);
+  }
+}
+
+static bool columnHigh(const simhalf_t &h, uint8_t col) {
+  return !h.pulled[col] && (h.releasedAt[col] == kNever ||
+                            simNanos - h.releasedAt[col] >= h.rise[col]);
+}
+
+// The switch contacts, bounces included, in time order
+struct contactevent_t {
+  uint64_t at;
+  uint8_t key;
+  bool closed;
+};
+static std::vector<contactevent_t> contactEvents;
+static size_t nextContact = 0;
+
+static void advance(uint64_t nanos) {
+  simNanos += nanos;
+  while (nextContact < contactEvents.size() &&
+         contactEvents[nextContact].at <= simNanos) {
+    const auto &ev = contactEvents[nextContact++];
+    auto &k = keys[ev.key];
+    k.closed = ev.closed;
+    k.lastChange = ev.at;
+    halves[k.half].closed[k.row][k.col] = ev.closed;
+    updateColumn(halves[k.half], k.col, ev.at);
+  }
+}
+
+uint32_t micros() {
+  advance(kMicrosCost);
+  return simNanos / 1000;
+}
+
+uint32_t millis() {
+  return simNanos / 1000000;
+}
+
+void delayMicroseconds(uint32_t us) {
+  advance(uint64_t(us) * 1000);
+}
+
+// The Feather side
+static int pinModes[64];
+static int pinLevels[64];
+
+static int indexOf(const int *pins, uint8_t count, int pin) {
+  for (uint8_t i = 0; i < count; ++i) {
+    if (pins[i] == pin) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void updatePin(int pin) {
+  auto &h = halves[0];
+  int row = indexOf(rowPins, kRowLines, pin);
+  if (row >= 0) {
+    h.rowLow[row] = pinModes[pin] == OUTPUT && pinLevels[pin] == LOW;
+  }
+  int col = indexOf(colPins, kColLines, pin);
+  if (col >= 0) {
+    h.colDriven[col] = pinModes[pin] == OUTPUT && pinLevels[pin] == LOW;
+  }
+  updateHalf(h);
+}
+
+void pinMode(int pin, int mode) {
+  advance(kPinModeCost);
+  pinModes[pin] = mode;
+  updatePin(pin);
+}
+
+void digitalWrite(int pin, int level) {
+  advance(kPinCost);
+  pinLevels[pin] = level;
+  updatePin(pin);
+}
+
+int digitalRead(int pin) {
+  advance(kPinCost);
+  int col = indexOf(colPins, kColLines, pin);
+  if (col >= 0 && pinModes[pin] != OUTPUT) {
+    return columnHigh(halves[0], col);
+  }
+  return pinModes[pin] == OUTPUT ? pinLevels[pin] : HIGH;
+}
+
+// The SX1509 on the right half.  Bank A drives the rows and bank
+// B reads the columns; a 0 direction bit is an output.
+static uint8_t sxRegs[256];
+static uint8_t sxPointer;
+static uint8_t sxResetStep;
+
+static void sxReset() {
+  memset(sxRegs, 0, sizeof(sxRegs));
+  sxRegs[SX1509::kRegDirectionA] = 0xff;
+  sxRegs[SX1509::kRegDirectionB] = 0xff;
+  sxRegs[SX1509::kRegDataA] = 0xff;
+  sxRegs[SX1509::kRegDataB] = 0xff;
+  sxRegs[SX1509::kRegInterruptMaskA] = 0xff;
+  sxRegs[SX1509::kRegInterruptMaskB] = 0xff;
+}
+
+static void sxUpdatePins() {
+  auto &h = halves[1];
+  for (uint8_t row = 0; row < kRowLines; ++row) {
+    uint8_t bit = 1 << expRowPins[row];
+    h.rowLow[row] = !(sxRegs[SX1509::kRegDirectionA] & bit) &&
+                    !(sxRegs[SX1509::kRegDataA] & bit);
+  }
+  for (uint8_t col = 0; col < kColLines; ++col) {
+    uint8_t bit = 1 << (expColPins[col] - 8);
+    h.colDriven[col] = !(sxRegs[SX1509::kRegDirectionB] & bit) &&
+                       !(sxRegs[SX1509::kRegDataB] & bit);
+  }
+  updateHalf(h);
+}
+
+static void sxWrite(uint8_t reg, uint8_t value) {
+  if (reg == SX1509::kRegReset) {
+    sxResetStep = value == 0x12 ? 1 : sxResetStep == 1 && value == 0x34 ? 2 : 0;
+    if (sxResetStep == 2) {
+      sxReset();
+      sxUpdatePins();
+    }
+    return;
+  }
+  sxRegs[reg] = value;
+  sxUpdatePins();
+}
+
+static uint8_t sxRead(uint8_t reg) {
+  if (reg != SX1509::kRegDataB) {
+    return sxRegs[reg];
+  }
+  uint8_t bits = 0xff;
+  for (uint8_t col = 0; col < kColLines; ++col) {
+    uint8_t bit = 1 << (expColPins[col] - 8);
+    if ((sxRegs[SX1509::kRegDirectionB] & bit) && !columnHigh(halves[1], col)) {
+      bits &= ~bit;
+    }
+  }
+  return bits;
+}
+
+// The bus, costed a bit time per bit at the bus clock
+static uint32_t busClock = 100000;
+static uint8_t txAddress;
+static uint8_t txBytes[8];
+static uint8_t txCount;
+static uint8_t rxBytes[8];
+static uint8_t rxCount;
+static uint8_t rxNext;
+
+static void busBits(uint32_t bits) {
+  advance(uint64_t(bits) * 1000000000 / busClock);
+}
+
+void TwoWire::begin() {}
+void TwoWire::end() {}
+
+void TwoWire::setClock(uint32_t hz) {
+  busClock = hz;
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  txAddress = address;
+  txCount = 0;
+}
+
+size_t TwoWire::write(uint8_t byte) {
+  if (txCount < sizeof(txBytes)) {
+    txBytes[txCount++] = byte;
+  }
+  return 1;
+}
+
+uint8_t TwoWire::endTransmission(bool stop) {
+  // START and address
+  busBits(1 + 9);
+  if (txAddress != SX1509::kDefaultAddress) {
+    busBits(1);
+    return 2;
+  }
+  for (uint8_t i = 0; i < txCount; ++i) {
+    busBits(9);
+    if (i == 0) {
+      sxPointer = txBytes[0];
+    } else {
+      sxWrite(sxPointer++, txBytes[i]);
+    }
+  }
+  if (stop) {
+    busBits(1);
+  }
+  return 0;
+}
+
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t count) {
+  busBits(1 + 9);
+  rxCount = rxNext = 0;
+  if (address != SX1509::kDefaultAddress) {
+    busBits(1);
+    return 0;
+  }
+  for (uint8_t i = 0; i < count && i < sizeof(rxBytes); ++i) {
+    // The pins are sampled as the byte goes out
+    rxBytes[rxCount++] = sxRead(sxPointer++);
+    busBits(9);
+  }
+  busBits(1);
+  return rxCount;
+}
+
+int TwoWire::available() {
+  return rxCount - rxNext;
+}
+
+int TwoWire::read() {
+  return rxNext < rxCount ? rxBytes[rxNext++] : -1;
+}
+
+TwoWire Wire;
+
+// The engine's reports go nowhere, but we keep the last one
+static KeyReport lastReport;
+static uint32_t numReports = 0;
+
+Keyboard_::Keyboard_(void) {}
+void Keyboard_::begin(void) {}
+void Keyboard_::end(void) {}
+void Keyboard_::sendReport(KeyReport *keys) {
+  lastReport = *keys;
+  ++numReports;
+}
+void Keyboard_::sendConsumerReport(ConsumerReport *) {}
+void Keyboard_::sendMouseReport(MouseReport *) {}
+void Keyboard_::sendVendorReport(VendorReport *) {}
+void Keyboard_::releaseAll(void) {
+  memset(&lastReport, 0, sizeof(lastReport));
+}
+Keyboard_ Keyboard;
+
+void requestTraceReplay() {}
+void requestSyntheticReplay() {}
+void requestPropertyCheck() {}
+
+static double randomUnit() {
+  return rand() / (RAND_MAX + 1.0);
+}
+
+// Adds a change of key to closed at time at, followed by edges
+// extra bounces within bounce nanoseconds
+static void addContact(uint8_t key, bool closed, uint64_t at,
+                       uint8_t edges, uint64_t bounce) {
+  std::vector<uint64_t> times;
+  for (uint8_t i = 0; i < edges * 2; ++i) {
+    times.push_back(at + 1 + uint64_t(randomUnit() * bounce));
+  }
+  std::sort(times.begin(), times.end());
+  contactEvents.push_back({at, key, closed});
+  bool state = closed;
+  for (auto t : times) {
+    state = !state;
+    contactEvents.push_back({t, key, state});
+  }
+}
+
+// Types count keystrokes of up to three keys at a time; returns
+// when the last one is done
+static uint64_t typeKeystrokes(uint32_t count, uint8_t maxEdges,
+                               uint64_t maxBounce) {
+  uint64_t freeAt[matrix_t::kKeys] = {};
+  std::vector<uint64_t> releases;
+  uint64_t t = simNanos + 100000000;
+  uint64_t end = t;
+  for (uint32_t n = 0; n < count; ++n) {
+    // The gap between presses averages 80ms
+    t += 10000000 + uint64_t(randomUnit() * 140000000);
+    releases.erase(std::remove_if(releases.begin(), releases.end(),
+                                  [&](uint64_t r) { return r <= t; }),
+                   releases.end());
+    if (releases.size() >= 3) {
+      t = *std::min_element(releases.begin(), releases.end()) + 1;
+      --n;
+      continue;
+    }
+    uint8_t key;
+    do {
+      key = rand() % matrix_t::kKeys;
+    } while (freeAt[key] > t);
+    uint64_t hold = 40000000 + uint64_t(randomUnit() * 110000000);
+    uint64_t bounce = uint64_t(randomUnit() * maxBounce);
+    uint8_t edges = maxEdges ? rand() % (maxEdges + 1) : 0;
+    addContact(key, true, t, edges, bounce);
+    addContact(key, false, t + hold, edges, bounce);
+    releases.push_back(t + hold);
+    freeAt[key] = t + hold + maxBounce + 1;
+    end = std::max(end, freeAt[key]);
+  }
+  std::stable_sort(contactEvents.begin(), contactEvents.end(),
+                   [](const contactevent_t &a, const contactevent_t &b) {
+                     return a.at < b.at;
+                   });
+  return end + 100000000;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-n KEYSTROKES] [-l LOCAL_RISE_US] "
+          "[-r EXPANDER_RISE_US]\n"
+          "          [-b MAX_BOUNCE_US] [-e MAX_BOUNCE_EDGES] "
+          "[-c I2C_HZ] [-f] [-s SEED]\n"
+          "  -f scans with the fixed settle time instead of calibrating\n",
+          argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  uint32_t keystrokes = 2000;
+  double localRise = 5, expanderRise = 15, maxBounce = 1500;
+  uint8_t maxEdges = 4;
+  bool fixedSettle = false;
+  unsigned seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:l:r:b:e:c:fs:")) != -1) {
+    switch (opt) {
+      case 'n':
+        keystrokes = atoi(optarg);
+        break;
+      case 'l':
+        localRise = atof(optarg);
+        break;
+      case 'r':
+        expanderRise = atof(optarg);
+        break;
+      case 'b':
+        maxBounce = atof(optarg);
+        break;
+      case 'e':
+        maxEdges = atoi(optarg);
+        break;
+      case 'c':
+        busClock = atoi(optarg);
+        break;
+      case 'f':
+        fixedSettle = true;
+        break;
+      case 's':
+        seed = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  srand(seed);
+
+  // Each column line rises within 20% of the nominal time
+  for (uint8_t col = 0; col < kColLines; ++col) {
+    halves[0].rise[col] = localRise * 1000 * (0.8 + 0.4 * randomUnit());
+    halves[1].rise[col] = expanderRise * 1000 * (0.8 + 0.4 * randomUnit());
+  }
+  for (uint16_t scanCode = 0; scanCode < matrix_t::kKeys; ++scanCode) {
+    auto &k = keys[kKeyAtScanCode[scanCode]];
+    uint8_t col = scanCode % matrix_t::kCols;
+    // The KEYMAP columns are c0-c6 of the left hand, then c0-c6 of
+    // the right hand
+    k.half = col / kColLines;
+    k.row = scanCode / matrix_t::kCols;
+    k.col = col % kColLines;
+    k.scanCode = scanCode;
+  }
+  sxReset();
+
+  initKeyScanner();
+  // As the firmware does on its first idle pass
+  calibrateKeyScanner();
+  if (fixedSettle) {
+    for (auto &settle : rowSettle) {
+      settle.expander = kDefaultSettle;
+      settle.local = kDefaultSettle;
+    }
+  }
+  resetKeyState();
+  for (uint8_t row = 0; row < kRowLines; ++row) {
+    printf("row %d settle: local=%dus expander=%dus\n", row,
+           rowSettle[row].local, rowSettle[row].expander);
+  }
+
+  auto end = typeKeystrokes(keystrokes, maxEdges, uint64_t(maxBounce * 1000));
+  uint32_t scans = 0, phantoms = 0, misses = 0;
+  uint64_t totalScan = 0, maxScan = 0;
+  while (simNanos < end) {
+    auto scanStart = simNanos;
+    auto down = readMatrix();
+    auto scanTime = simNanos - scanStart;
+    ++scans;
+    totalScan += scanTime;
+    maxScan = std::max(maxScan, scanTime);
+
+    for (const auto &k : keys) {
+      if (k.lastChange >= scanStart) {
+        // Changed during the scan; either reading is right
+        continue;
+      }
+      bool isDown = down.isDown(k.scanCode);
+      if (isDown && !k.closed) {
+        ++phantoms;
+      } else if (!isDown && k.closed) {
+        ++misses;
+      }
+    }
+    processMatrix(down, nowMicros());
+  }
+
+  bool stuck = keyStates.down || lastReport.modifiers;
+  for (auto key : lastReport.keys) {
+    stuck |= key != 0;
+  }
+  printf("scans=%u scanTime mean=%lluus max=%lluus phantoms=%u misses=%u "
+         "reports=%u stuck=%d\n",
+         scans, (unsigned long long)(totalScan / scans / 1000),
+         (unsigned long long)(maxScan / 1000), phantoms, misses, numReports,
+         stuck);
+  return phantoms || misses || stuck;
+}
@@ -0,0 +1,175 @@
+// spock-schedtest checks the cooperative scheduler of scheduler.h
+// against the mock clock: that released tasks run in priority
+// order, that tasks released while others run are picked up in the
+// same run() and in order, that a second release keeps the first
+// release time, and that run times and missed deadlines are
+// counted as they should be.  It prints each failed check and
+// exits non-zero if there were any; make check runs it.
+
+#define TIMEBASE_MOCK 1
+
+#include "Arduino.h"
+#include "timebase.h"
+#include "scheduler.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                              \
+  do {                                                           \
+    if (!(cond)) {                                               \
+      fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+              #cond);                                            \
+      ++failures;                                                \
+    }                                                            \
+  } while (0)
+
+// The order in which the tasks ran, one digit per run
+static char ran[32];
+static uint8_t numRan = 0;
+// How long each task takes, in mock microseconds
+static uint32_t runTime[Scheduler::kMaxTasks];
+// A task for each task to release when it runs, or -1
+static int8_t releases[Scheduler::kMaxTasks];
+static uint8_t selfReleases = 0;
+
+static void runTask(uint8_t id, usec_t now) {
+  if (numRan < sizeof(ran) - 1) {
+    ran[numRan++] = '0' + id;
+    ran[numRan] = 0;
+  }
+  timebaseMockNow = now + runTime[id];
+  if (releases[id] >= 0) {
+    if (releases[id] == id && selfReleases-- == 0) {
+      return;
+    }
+    scheduler.release(releases[id], timebaseMockNow);
+  }
+}
+
+static void task0(usec_t now) {
+  runTask(0, now);
+}
+static void task1(usec_t now) {
+  runTask(1, now);
+}
+static void task2(usec_t now) {
+  runTask(2, now);
+}
+static void task3(usec_t now) {
+  runTask(3, now);
+}
+static void task4(usec_t now) {
+  runTask(4, now);
+}
+
+static const Task kTestTasks[] = {
+    {task0, 100}, {task1, 200}, {task2, 300}, {task3, 400}, {task4, 500},
+};
+
+static void reset() {
+  scheduler.init(kTestTasks, sizeof(kTestTasks) / sizeof(kTestTasks[0]));
+  numRan = 0;
+  ran[0] = 0;
+  memset(runTime, 0, sizeof(runTime));
+  memset(releases, -1, sizeof(releases));
+  selfReleases = 0;
+  timebaseMockNow = 1000;
+}
+
+static void checkPriorityOrder() {
+  reset();
+  scheduler.release(3, 1000);
+  scheduler.release(1, 1000);
+  scheduler.release(4, 1000);
+  scheduler.release(2, 1000);
+  CHECK(scheduler.pending(3) && !scheduler.pending(0));
+  scheduler.run();
+  CHECK(strcmp(ran, "1234") == 0);
+  CHECK(!scheduler.pending(3));
+  // Nothing is left to run
+  scheduler.run();
+  CHECK(numRan == 4);
+}
+
+static void checkReleaseWhileRunning() {
+  reset();
+  // 2 releases 0, which outranks 3; 3 releases 4 and 4 releases 1
+  releases[2] = 0;
+  releases[3] = 4;
+  releases[4] = 1;
+  scheduler.release(3, 1000);
+  scheduler.release(2, 1000);
+  scheduler.run();
+  CHECK(strcmp(ran, "20341") == 0);
+}
+
+static void checkSelfRelease() {
+  reset();
+  releases[1] = 1;
+  selfReleases = 2;
+  scheduler.release(1, 1000);
+  scheduler.release(2, 1000);
+  scheduler.run();
+  CHECK(strcmp(ran, "1112") == 0);
+  CHECK(scheduler.stats[1].runs == 3);
+}
+
+static void checkOutOfRange() {
+  reset();
+  scheduler.init(kTestTasks, 2);
+  scheduler.release(2, 1000);
+  scheduler.release(7, 1000);
+  CHECK(!scheduler.pending(2) && !scheduler.pending(7));
+  scheduler.run();
+  CHECK(numRan == 0);
+}
+
+static void checkDeadlines() {
+  reset();
+  // Task 0 has 100us; it is released at 1000 and runs at 1080
+  // for 30us, so it is late even though the run itself was short
+  runTime[0] = 30;
+  timebaseMockNow = 1080;
+  scheduler.release(0, 1000);
+  // A second release doesn't move the release time
+  scheduler.release(0, 1080);
+  scheduler.run();
+  CHECK(scheduler.stats[0].runs == 1);
+  CHECK(scheduler.stats[0].missed == 1);
+  CHECK(scheduler.stats[0].maxRunTime == 30);
+
+  // Task 1 has 200us and finishes on its deadline, then well inside
+  // it; the longer run is kept
+  runTime[1] = 200;
+  scheduler.release(1, timebaseMockNow);
+  scheduler.run();
+  runTime[1] = 50;
+  scheduler.release(1, timebaseMockNow);
+  scheduler.run();
+  CHECK(scheduler.stats[1].runs == 2);
+  CHECK(scheduler.stats[1].missed == 0);
+  CHECK(scheduler.stats[1].maxRunTime == 200);
+
+  // Task 2 waits behind a slow task 1 and misses its 300us
+  runTime[1] = 250;
+  runTime[2] = 60;
+  scheduler.release(2, timebaseMockNow);
+  scheduler.release(1, timebaseMockNow);
+  scheduler.run();
+  CHECK(scheduler.stats[1].missed == 1);
+  CHECK(scheduler.stats[2].missed == 1);
+  CHECK(scheduler.stats[2].maxRunTime == 60);
+}
+
+int main() {
+  checkPriorityOrder();
+  checkReleaseWhileRunning();
+  checkSelfRelease();
+  checkOutOfRange();
+  checkDeadlines();
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
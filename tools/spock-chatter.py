@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+# Reads the per-key chatter statistics that Spockduino streams over
+# the vendor diagnostics report (report ID 3) and prints them, with
+# a suggested debounce time for each key that bounces.
+# Build the firmware with CHATTER set to 1 and run this against the
+# hidraw node for the keyboard, eg: spock-chatter.py /dev/hidraw3
+# The matrix size comes from matrix_t in Spockduino/keymap.h, so this
+# must be run against the sources that the firmware was built from.
+import argparse
+import os
+import re
+import struct
+
+REPORT_ID = 3
+KIND_CHATTER = 7
+RECORD = struct.Struct("<HHBB")
+PER_PAGE = 60 // RECORD.size
+BURST_UNIT = 64  # microseconds
+# Presses closer together than this are most likely chatter
+SUSPECT_INTERVAL = 40  # milliseconds
+
+SOURCE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "..", "Spockduino")
+
+
+def read_matrix(source_dir):
+    """Returns the (rows, cols) of matrix_t"""
+    with open(os.path.join(source_dir, "keymap.h")) as f:
+        text = f.read()
+    match = re.search(r"typedef\s+Matrix<\s*(\d+)\s*,\s*(\d+)\s*>"
+                      r"\s+matrix_t;", text)
+    return int(match.group(1)), int(match.group(2))
+
+
+def show(keys, num_cols):
+    print("key  row col  presses  bounces  max burst  min interval  debounce")
+    for scan_code, (presses, bounces, max_burst, min_interval) in \
+            sorted(keys.items(), key=lambda k: -k[1][1]):
+        if not presses and not bounces:
+            continue
+        burst = max_burst * BURST_UNIT
+        interval = "%dms" % min_interval if min_interval != 0xff else "-"
+        suspect = " suspect" if min_interval < SUSPECT_INTERVAL else ""
+        # Round the longest burst up to the next millisecond
+        debounce = "%dms" % ((burst + 999) // 1000) if bounces else "-"
+        print("%3d  %3d %3d  %7d  %7d  %7dus  %12s  %8s%s" %
+              (scan_code, scan_code // num_cols, scan_code % num_cols,
+               presses, bounces, burst, interval, debounce, suspect))
+    print()
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Prints the Spockduino chatter statistics")
+    parser.add_argument("device", help="the hidraw node")
+    parser.add_argument("--source", default=SOURCE_DIR,
+                        help="the Spockduino sources, for the matrix size")
+    args = parser.parse_args()
+    num_rows, num_cols = read_matrix(args.source)
+    num_keys = num_rows * num_cols
+    keys = {}
+    num_pages = (num_keys + PER_PAGE - 1) // PER_PAGE
+    with open(args.device, "rb") as dev:
+        while True:
+            report = dev.read(64)
+            if not report or report[0] != REPORT_ID:
+                continue
+            kind, index = report[1], report[2]
+            if kind != KIND_CHATTER:
+                continue
+            data = report[3:63]
+            for n in range(PER_PAGE):
+                scan_code = index * PER_PAGE + n
+                if scan_code < num_keys:
+                    keys[scan_code] = RECORD.unpack_from(data, n * RECORD.size)
+            if index == num_pages - 1:
+                show(keys, num_cols)
+
+
+if __name__ == "__main__":
+    main()
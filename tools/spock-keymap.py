@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+# Loads a new keymap into a running Spockduino without reflashing.
+# The layout is written just as in keymap.h: a file holding one
+# KEYMAP(...) per layer, using the same KEY(), MOD(), LAYER() and
+# so on.  keymap.h itself will do, which loads the built in keymap.
+# We expand the macros using the definitions from the Spockduino
+# sources, pack the layers and send them over the vendor report
+# (report ID 3), then wait for the keyboard to say whether it took
+# them.  Build the firmware with HOTSWAP set to 1, then:
+#
+#   spock-keymap.py my-layout.h /dev/hidraw3
+#   spock-keymap.py --reset /dev/hidraw3
+#
+# -o writes the reports to a file instead, which spock-evdev -k
+# can load, for trying a layout out on the host.
+import argparse
+import os
+import re
+import select
+import struct
+import sys
+import zlib
+
+REPORT_ID = 3
+KIND_KEYMAP_CHUNK = 9
+KIND_KEYMAP_COMMIT = 10
+KIND_KEYMAP_STATUS = 11
+CHUNK_SIZE = 60
+MAX_LAYERS = 4
+STATUS = ["ok", "bad crc", "missing chunks", "bad layers", "bad opcode"]
+
+SOURCE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "..", "Spockduino")
+HEADERS = ["HIDTables.h", "keycodes.h", "keymap.h"]
+
+
+def strip_comments(text):
+    text = re.sub(r"/\*.*?\*/", " ", text, flags=re.S)
+    return re.sub(r"//[^\n]*", "", text)
+
+
+def split_args(text, start):
+    """Splits the parenthesized arguments at text[start], which must
+    be "(", returning them and the offset just past the ")"."""
+    depth = 0
+    args = []
+    arg = ""
+    for i in range(start, len(text)):
+        c = text[i]
+        if c == "(":
+            depth += 1
+            if depth == 1:
+                continue
+        elif c == ")":
+            depth -= 1
+            if depth == 0:
+                args.append(arg.strip())
+                return args, i + 1
+        elif c == "," and depth == 1:
+            args.append(arg.strip())
+            arg = ""
+            continue
+        arg += c
+    raise ValueError("unbalanced parentheses")
+
+
+class Macros:
+    def __init__(self, source_dir):
+        self.defines = {}
+        self.constants = {}
+        self.num_keys = None
+        for name in HEADERS:
+            with open(os.path.join(source_dir, name)) as f:
+                text = strip_comments(f.read().replace("\\\n", " "))
+            # The keys per layer come from the matrix, matrix_t
+            m = re.search(r"typedef\s+Matrix<\s*(\d+)\s*,\s*(\d+)\s*>"
+                          r"\s+matrix_t;", text)
+            if m:
+                self.num_keys = int(m.group(1)) * int(m.group(2))
+            for m in re.finditer(r"^\s*#define\s+(\w+)(\(([^)]*)\))?(.*)$",
+                                 text, re.M):
+                params = None
+                if m.group(2):
+                    params = [p.strip() for p in m.group(3).split(",")]
+                self.defines[m.group(1)] = (params, m.group(4).strip())
+            for m in re.finditer(
+                    r"static constexpr uint32_t (\w+) = (0x[0-9a-fA-F]+);",
+                    text):
+                self.constants[m.group(1)] = int(m.group(2), 16)
+
+    def expand(self, text, depth=0):
+        if depth > 16:
+            raise ValueError("macro recursion: %s" % text)
+        out = ""
+        pos = 0
+        for m in re.finditer(r"[A-Za-z_]\w*", text):
+            if m.start() < pos:
+                continue
+            out += text[pos:m.start()]
+            pos = m.end()
+            name = m.group(0)
+            if name not in self.defines:
+                out += name
+                continue
+            params, body = self.defines[name]
+            if params is None:
+                out += "(" + self.expand(body, depth + 1) + ")"
+                continue
+            paren = text.find("(", pos)
+            args, pos = split_args(text, paren)
+            if name == "PASTE":
+                out += self.expand(args[0] + args[1], depth + 1)
+                continue
+            subst = re.sub(r"[A-Za-z_]\w*",
+                           lambda p: args[params.index(p.group(0))]
+                           if p.group(0) in params else p.group(0), body)
+            out += self.expand(subst, depth + 1)
+        return out + text[pos:]
+
+    def action(self, text):
+        expr = self.expand(text).replace("uint32_t(", "(")
+        return eval(expr, {"__builtins__": {}}, dict(self.constants))
+
+    def keymap_order(self):
+        """Returns, for each scan code, the index of the KEYMAP()
+        argument that lands there"""
+        params, body = self.defines["KEYMAP"]
+        names = [n.strip() for n in body.strip("{} ").split(",")]
+        return [params.index(n) for n in names]
+
+
+def read_layers(path, macros):
+    with open(path) as f:
+        text = strip_comments(f.read())
+    order = macros.keymap_order()
+    layers = []
+    for m in re.finditer(r"(#define\s+)?\bKEYMAP\s*\(", text):
+        if m.group(1):
+            continue
+        args, _ = split_args(text, m.end() - 1)
+        if len(args) != macros.num_keys:
+            raise ValueError("KEYMAP() with %d keys, not %d" %
+                             (len(args), macros.num_keys))
+        layers.append([macros.action(args[i]) for i in order])
+    return layers
+
+
+def check_layers(layers):
+    if not 1 <= len(layers) <= MAX_LAYERS:
+        raise ValueError("%d layers; the keyboard takes 1 to %d" %
+                         (len(layers), MAX_LAYERS))
+    for actions in layers:
+        for action in actions:
+            if action & 0xF00 == 0x300 and action & 0xFF >= len(layers):
+                raise ValueError("LAYER(%d) but only %d layers" %
+                                 (action & 0xFF, len(layers)))
+
+
+def make_reports(layers):
+    data = b"".join(struct.pack("<%dI" % len(actions), *actions)
+                    for actions in layers)
+    reports = []
+    for index in range(0, (len(data) + CHUNK_SIZE - 1) // CHUNK_SIZE):
+        chunk = data[index * CHUNK_SIZE:(index + 1) * CHUNK_SIZE]
+        reports.append(bytes([REPORT_ID, KIND_KEYMAP_CHUNK, index]) +
+                       chunk.ljust(CHUNK_SIZE, b"\0"))
+    commit = struct.pack("<B3xI", len(layers), zlib.crc32(data) & 0xFFFFFFFF)
+    reports.append(bytes([REPORT_ID, KIND_KEYMAP_COMMIT, 0]) +
+                   commit.ljust(CHUNK_SIZE, b"\0"))
+    return reports
+
+
+def upload(device, reports):
+    fd = os.open(device, os.O_RDWR)
+    try:
+        for report in reports:
+            os.write(fd, report)
+        while True:
+            ready, _, _ = select.select([fd], [], [], 2.0)
+            if not ready:
+                print("no reply; is the firmware built with HOTSWAP?")
+                return 1
+            report = os.read(fd, 64)
+            if report[0] == REPORT_ID and report[1] == KIND_KEYMAP_STATUS:
+                status, layers, crc = struct.unpack("<BB2xI", report[3:11])
+                print("%s: %d layers active, crc %08x" %
+                      (STATUS[status] if status < len(STATUS) else status,
+                       layers, crc))
+                return 0 if status == 0 else 1
+    finally:
+        os.close(fd)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Loads a keymap into a running Spockduino")
+    parser.add_argument("layout", nargs="?",
+                        help="file of KEYMAP() layers, as in keymap.h")
+    parser.add_argument("device", nargs="?", help="the hidraw node")
+    parser.add_argument("-o", "--output",
+                        help="write the reports here instead")
+    parser.add_argument("--reset", action="store_true",
+                        help="go back to the built in keymap")
+    parser.add_argument("--source", default=SOURCE_DIR,
+                        help="the Spockduino sources, for the macros")
+    args = parser.parse_args()
+    if args.reset:
+        # Only the device was given
+        args.device = args.device or args.layout
+        reports = make_reports([])[-1:]
+    else:
+        if not args.layout:
+            parser.error("a layout is needed, unless --reset")
+        layers = read_layers(args.layout, Macros(args.source))
+        try:
+            check_layers(layers)
+        except ValueError as e:
+            print("%s: %s" % (args.layout, e))
+            return 1
+        reports = make_reports(layers)
+    if args.output:
+        with open(args.output, "wb") as f:
+            for report in reports:
+                f.write(report)
+        return 0
+    if not args.device:
+        parser.error("a device is needed, unless -o")
+    return upload(args.device, reports)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+# Prints the deferred log that Spockduino streams over the vendor
+# diagnostics report (report ID 3).  The keyboard sends only message
+# IDs and raw arguments; the format strings come from the
+# LOG_MESSAGES table in Spockduino/log.h, which we read at startup,
+# so this must be run against the sources that the firmware was
+# built from.  Build the firmware with LOG set to 1 and run this
+# against the hidraw node for the keyboard, eg:
+# spock-log.py /dev/hidraw3
+import argparse
+import os
+import re
+import struct
+import sys
+
+REPORT_ID = 3
+KIND_LOG = 12
+WORDS_PER_PAGE = 60 // 4
+
+SOURCE_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                          "..", "Spockduino")
+
+
+def read_formats(source_dir):
+    """Returns the (name, format) of each message, in ID order"""
+    with open(os.path.join(source_dir, "log.h")) as f:
+        text = f.read()
+    table = re.search(r"#define LOG_MESSAGES\(X\)(.*?)\n\n", text, re.S)
+    return re.findall(r'X\((\w+),\s*"((?:[^"\\]|\\.)*)"\)', table.group(1))
+
+
+def format_record(formats, ident, time, args):
+    if ident >= len(formats):
+        return "%10d unknown message %d %s" % (time, ident, args)
+    name, fmt = formats[ident]
+    try:
+        text = fmt % tuple(args)
+    except TypeError:
+        text = "%s (bad arguments %s)" % (fmt, args)
+    return "%10d %s" % (time, text)
+
+
+def decode_page(formats, data):
+    words = struct.unpack("<%dI" % WORDS_PER_PAGE, data)
+    pos = 0
+    while pos < len(words) and words[pos]:
+        ident, num_args = words[pos] & 0xff, words[pos] >> 8 & 0xff
+        time = words[pos + 1]
+        args = list(words[pos + 2:pos + 2 + num_args])
+        yield format_record(formats, ident, time, args)
+        pos += 2 + num_args
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Prints the Spockduino deferred log")
+    parser.add_argument("device", help="the hidraw node")
+    parser.add_argument("--source", default=SOURCE_DIR,
+                        help="the Spockduino sources, for the formats")
+    args = parser.parse_args()
+    formats = read_formats(args.source)
+    page = None
+    with open(args.device, "rb") as dev:
+        while True:
+            report = dev.read(64)
+            if not report or report[0] != REPORT_ID:
+                continue
+            kind, index = report[1], report[2]
+            if kind != KIND_LOG:
+                continue
+            if page is not None and index != (page + 1) & 0xff:
+                print("missed %d pages" % ((index - page - 1) & 0xff))
+            page = index
+            for line in decode_page(formats, report[3:63]):
+                print(line)
+            sys.stdout.flush()
+
+
+if __name__ == "__main__":
+    main()
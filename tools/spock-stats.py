@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Reads the instrumentation pages that Spockduino streams over the
+# vendor diagnostics report (report ID 3) and prints them.
+# Build the firmware with INSTRUMENT set to 1 and run this against
+# the hidraw node for the keyboard, eg: spock-stats.py /dev/hidraw3
+import struct
+import sys
+
+REPORT_ID = 3
+KIND_HISTOGRAM = 1
+KIND_COUNTERS = 2
+KIND_TASKS = 5
+KIND_EXPANDERS = 6
+
+HISTOGRAMS = ["scan", "i2c read", "debounce", "scan to report", "usb send",
+              "scan to sof", "report delivery", "report interval"]
+COUNTERS = ["scans", "reports", "key events", "dropped keys",
+            "i2c errors", "debounce resets", "settle us saved",
+            "expander offline", "expander retries", "boot ready us",
+            "boot configured us", "boot first report us"]
+TASKS = ["dispatch", "process", "scan", "macro", "diagnostics"]
+NUM_BUCKETS = 15
+
+
+def bucket_label(n):
+    if n == NUM_BUCKETS - 1:
+        return ">=%dus" % (1 << n)
+    return "<%dus" % (1 << (n + 1))
+
+
+def show(histograms, counters, tasks, expanders):
+    for idx, buckets in sorted(histograms.items()):
+        name = HISTOGRAMS[idx] if idx < len(HISTOGRAMS) else str(idx)
+        print("%s:" % name)
+        for n, count in enumerate(buckets):
+            if count:
+                print("  %10s %d" % (bucket_label(n), count))
+    for name, value in zip(COUNTERS, counters):
+        print("%s: %d" % (name, value))
+    for name, (runs, missed, max_run) in zip(TASKS, tasks):
+        print("task %s: runs=%d missed=%d max=%dus" %
+              (name, runs, missed, max_run))
+    for n, (reads, errors, total, max_read) in enumerate(expanders):
+        if reads:
+            print("expander %d: reads=%d errors=%d avg=%dus max=%dus" %
+                  (n, reads, errors, total // reads, max_read))
+    print()
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("usage: %s /dev/hidrawN" % sys.argv[0])
+        sys.exit(1)
+    histograms = {}
+    counters = []
+    tasks = []
+    expanders = []
+    with open(sys.argv[1], "rb") as dev:
+        while True:
+            report = dev.read(64)
+            if not report or report[0] != REPORT_ID:
+                continue
+            kind, index = report[1], report[2]
+            data = report[3:63]
+            if kind == KIND_HISTOGRAM:
+                histograms[index] = struct.unpack("<%dI" % NUM_BUCKETS, data)
+            elif kind == KIND_COUNTERS:
+                counters = struct.unpack("<15I", data)
+            elif kind == KIND_TASKS:
+                stats = struct.unpack("<15I", data)
+                tasks = [stats[i:i + 3] for i in range(0, len(stats), 3)]
+            elif kind == KIND_EXPANDERS:
+                stats = struct.unpack("<12I", data[:48])
+                expanders = [stats[i:i + 4] for i in range(0, len(stats), 4)]
+                show(histograms, counters, tasks, expanders)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+# Decodes the key event trace that Spockduino dumps when MACRO(1) is
+# pressed.  The trace can be read from a capture of the serial port,
+# from the serial port itself, or from the hidraw node for the
+# keyboard's vendor diagnostics report:
+#
+#   spock-trace.py dump.bin
+#   spock-trace.py /dev/ttyACM0
+#   spock-trace.py --hid /dev/hidraw3
+#
+# --raw writes the records out in the serial dump format so that a
+# trace captured over HID can be saved for later.
+import argparse
+import struct
+import sys
+
+MAGIC = 0x544B5053
+HEADER = struct.Struct("<IHH")
+RECORD = struct.Struct("<IIBBBB")
+REPORT_ID = 3
+KIND_TRACE_HEADER = 3
+KIND_TRACE = 4
+RECORDS_PER_PAGE = 60 // RECORD.size
+
+DOWN = 0x80
+REPORTED = 0x40
+NO_SLOT = 0x3F
+RESET = 0xFF
+
+OPCODES = {
+    0x100: "key",
+    0x200: "mod",
+    0x300: "layer",
+    0x400: "taphold",
+    0x500: "togglemod",
+    0x600: "key+mod",
+    0x700: "mouse",
+    0x800: "macro",
+    0x900: "consumer",
+    0xA00: "mousemove",
+}
+
+RESET_CAUSES = {
+    0x01: "power on",
+    0x02: "brown out 1.2V",
+    0x04: "brown out 3.3V",
+    0x10: "external",
+    0x20: "watchdog",
+    0x40: "system",
+}
+
+
+def describe_action(action):
+    opcode = action & 0xF00
+    name = OPCODES.get(opcode)
+    if name is None:
+        return "none" if action == 0 else "0x%x" % action
+    if opcode == 0x900:
+        return "%s(0x%03x)" % (name, action >> 16)
+    arg = action & 0xFF
+    extra = (action >> 16) & 0xFF
+    if extra:
+        return "%s(0x%02x, 0x%02x)" % (name, arg, extra)
+    return "%s(0x%02x)" % (name, arg)
+
+
+def read_exact(f, n):
+    data = b""
+    while len(data) < n:
+        chunk = f.read(n - len(data))
+        if not chunk:
+            raise EOFError("truncated trace")
+        data += chunk
+    return data
+
+
+def read_serial(f):
+    # Skip anything that precedes the header, such as replay output
+    window = b""
+    magic = struct.pack("<I", MAGIC)
+    while window != magic:
+        window = (window + read_exact(f, 1))[-4:]
+    _, count, size = HEADER.unpack(magic + read_exact(f, HEADER.size - 4))
+    return [read_exact(f, size)[: RECORD.size] for _ in range(count)]
+
+
+def read_hid(f):
+    count = None
+    records = []
+    while count is None or len(records) < count:
+        report = f.read(64)
+        if not report or report[0] != REPORT_ID:
+            continue
+        kind, data = report[1], report[3:63]
+        if kind == KIND_TRACE_HEADER:
+            magic, count, _ = HEADER.unpack(data[: HEADER.size])
+            if magic != MAGIC:
+                raise ValueError("bad trace magic 0x%x" % magic)
+            records = []
+        elif kind == KIND_TRACE and count is not None:
+            for i in range(RECORDS_PER_PAGE):
+                if len(records) < count:
+                    records.append(data[i * RECORD.size:(i + 1) * RECORD.size])
+    return records
+
+
+def show(records):
+    # Times are in milliseconds, from the low 32 bits of the
+    # firmware's microsecond clock
+    for raw in records:
+        time, action, scan_code, flags, layers, report_hash = RECORD.unpack(raw)
+        if scan_code == RESET:
+            causes = [n for bit, n in RESET_CAUSES.items() if action & bit]
+            print("%14.3f reset: %s" % (time / 1000.0,
+                                        ", ".join(causes) or "unknown"))
+            continue
+        slot = flags & NO_SLOT
+        print("%14.3f scan=%2d %-4s slot=%-7s layers=%s report=%s %s" % (
+            time / 1000.0,
+            scan_code,
+            "down" if flags & DOWN else "up",
+            "dropped" if slot == NO_SLOT else slot,
+            format(layers, "08b"),
+            "%02x" % report_hash if flags & REPORTED else "--",
+            describe_action(action)))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("path", help="dump file, serial port or hidraw node")
+    parser.add_argument("--hid", action="store_true",
+                        help="read vendor reports from a hidraw node")
+    parser.add_argument("--raw", metavar="FILE",
+                        help="save the records in the serial dump format")
+    args = parser.parse_args()
+
+    with open(args.path, "rb") as f:
+        records = read_hid(f) if args.hid else read_serial(f)
+
+    if args.raw:
+        with open(args.raw, "wb") as out:
+            out.write(HEADER.pack(MAGIC, len(records), RECORD.size))
+            out.write(b"".join(records))
+    show(records)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
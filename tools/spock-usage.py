@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# Reads the key usage counters that Spockduino sends over the
+# vendor diagnostics report (report ID 3) when MACRO(5) is pressed,
+# and prints them as a map of the matrix along with the most used
+# keys.  Build the firmware with USAGE set to 1 and run this
+# against the hidraw node for the keyboard, eg:
+# spock-usage.py /dev/hidraw3
+import struct
+import sys
+
+REPORT_ID = 3
+KIND_USAGE = 8
+NUM_ROWS = 6
+NUM_COLS = 14
+NUM_KEYS = NUM_ROWS * NUM_COLS
+PER_PAGE = 60 // 4
+
+
+def show(counts):
+    total = sum(counts)
+    print("presses: %d" % total)
+    for row in range(NUM_ROWS):
+        print(" ".join("%7d" % counts[row * NUM_COLS + col]
+                       for col in range(NUM_COLS)))
+    print("most used:")
+    ranked = sorted(range(NUM_KEYS), key=lambda k: -counts[k])
+    for scan_code in ranked[:20]:
+        if counts[scan_code]:
+            print("  key %3d (row %d col %2d) %7d %5.1f%%" %
+                  (scan_code, scan_code // NUM_COLS, scan_code % NUM_COLS,
+                   counts[scan_code], 100.0 * counts[scan_code] / total))
+    print()
+
+
+def main():
+    if len(sys.argv) != 2:
+        print("usage: %s /dev/hidrawN" % sys.argv[0])
+        sys.exit(1)
+    counts = [0] * NUM_KEYS
+    num_pages = (NUM_KEYS + PER_PAGE - 1) // PER_PAGE
+    with open(sys.argv[1], "rb") as dev:
+        while True:
+            report = dev.read(64)
+            if not report or report[0] != REPORT_ID:
+                continue
+            kind, index = report[1], report[2]
+            if kind != KIND_USAGE:
+                continue
+            page = struct.unpack("<%dI" % PER_PAGE, report[3:63])
+            for n, count in enumerate(page):
+                scan_code = index * PER_PAGE + n
+                if scan_code < NUM_KEYS:
+                    counts[scan_code] = count
+            if index == num_pages - 1:
+                show(counts)
+
+
+if __name__ == "__main__":
+    main()